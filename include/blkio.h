@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// block I/O interface to the image file
+//
+// every access to the image goes through read_at/write_at with an explicit
+// offset, so nothing depends on a shared file position. four backends:
+//  - pread: pread/pwrite on the descriptor (default)
+//  - stdio: fseek + fread/fwrite on the FILE stream
+//  - mmap:  memcpy into a MAP_SHARED mapping of the whole image; blk_ptr()
+//           hands out pointers into it, and flush msyncs the dirty pages
+//  - uring: io_uring with up to depth requests in flight; falls back to
+//           pread when the kernel does not support it
+//
+// a transfer that touches several parts of the image (a fragmented file,
+// the dirty blocks of the cache) is handed over as one list of segments
+// with read_segs/write_segs. backends without a batch path do the
+// segments one at a time.
+//
+// blk_copy_out() copies a range of the image into another file inside the
+// kernel, without passing the data through user space.
+#define BLK_QUEUE_DEPTH     32      // default io_uring queue depth
+#define COPY_BOUNCE_BYTES   (1 << 20)   // blk_copy_out() fallback buffer
+
+typedef struct blk_seg {
+    off_t offset;               // image offset
+    void *buf;
+    size_t len;
+    long done;                  // bytes transferred, set by the backend
+} blk_seg;
+
+typedef struct blkdev {
+    const char *name;           // backend name
+    long (*read_at)(struct blkdev *dev, off_t offset, void *buf, size_t len);
+    long (*write_at)(struct blkdev *dev, off_t offset, const void *buf, size_t len);
+    int (*flush)(struct blkdev *dev);
+    off_t (*size)(struct blkdev *dev);
+    int (*read_segs)(struct blkdev *dev, blk_seg *segs, int n);     // may be NULL
+    int (*write_segs)(struct blkdev *dev, blk_seg *segs, int n);    // may be NULL
+
+    FILE *fp;                   // stream the image was opened with
+    int fd;                     // its descriptor
+    off_t length;               // image size in bytes
+    unsigned char *map;         // mmap: start of the mapping, else NULL
+    uint64_t *dirty;            // mmap: one bit per page written since flush
+    long pages;                 // mmap: pages in the mapping
+    long page_size;             // mmap: msync granularity
+    void *ring;                 // uring: submission and completion rings
+} blkdev;
+
+blkdev *blk_open(const char *path, const char *backend, unsigned int depth);
+void blk_close(blkdev *dev);
+long blk_read_at(blkdev *dev, off_t offset, void *buf, size_t len);
+long blk_write_at(blkdev *dev, off_t offset, const void *buf, size_t len);
+int blk_read_segs(blkdev *dev, blk_seg *segs, int n);
+int blk_write_segs(blkdev *dev, blk_seg *segs, int n);
+int blk_flush(blkdev *dev);
+off_t blk_size(blkdev *dev);
+unsigned char *blk_ptr(blkdev *dev, off_t offset);
+long blk_copy_out(blkdev *dev, off_t offset, size_t len, int out_fd, off_t out_offset);
+
+// io_uring backend (blkio_uring.c)
+int uring_attach(blkdev *dev, unsigned int depth);
+void uring_detach(blkdev *dev);
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+#include "file_ops.h"
+
+// write-back block cache in front of the image file
+//
+// the image is cached in cluster-sized blocks, lined up so that every
+// data cluster is exactly one block. blocks are kept on an LRU list and
+// written back only when they are evicted, when more than dirty_max
+// blocks are dirty, or when cache_sync() is called (sync, close, exit).
+//
+// large reads of whole blocks that are not cached go straight to the
+// image without being inserted, so streaming a file does not push the
+// directory and FAT blocks out of the cache. cache_read_segs() does the
+// same for a whole list of segments and hands all of the uncached pieces
+// to the device as one batch; cache_sync() writes the dirty blocks back
+// as one batch too. cache_write_segs() is the write side: whole blocks
+// that are not cached are written straight to the image in one batch.
+//
+// when the image uses the mmap backend the cache holds nothing: reads and
+// writes go straight to the device and cache_sync() msyncs.
+#define CACHE_BLOCKS        256     // blocks held in memory
+#define CACHE_DIRTY_MAX     128     // default dirty blocks before a sync
+
+int cache_init(blkdev *img, BPB *b, unsigned int dirty_max);
+void cache_free(void);
+void cache_read(blkdev *img, off_t offset, void *buf, size_t len);
+void cache_read_segs(blkdev *img, blk_seg *segs, int n);
+void cache_write(blkdev *img, off_t offset, const void *buf, size_t len);
+void cache_write_segs(blkdev *img, blk_seg *segs, int n);
+void cache_sync(blkdev *img);
+unsigned int cache_dirty_count(void);
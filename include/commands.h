@@ -7,24 +7,36 @@
 void info(BPB *b);
 
 // Part 2: Navigation
-void ls(FILE *img, BPB *b, unsigned int cluster);
-unsigned int cd(FILE *img, BPB *b, unsigned int current_cluster, char *dirname);
+void ls(blkdev *img, BPB *b, unsigned int cluster);
+unsigned int cd(blkdev *img, BPB *b, unsigned int current_cluster, char *dirname);
 
 // part 3: creat and mkdir
-void fat32_mkdir(FILE *img, BPB *b, unsigned int current_cluster, const char *dirname);
-void fat32_creat(FILE *img, BPB *b, unsigned int current_cluster, const char *filename);
+void fat32_mkdir(blkdev *img, BPB *b, unsigned int cwd, const char *path);
+void fat32_creat(blkdev *img, BPB *b, unsigned int cwd, const char *path);
 
 // Part 4: Read 
-void open(char* filename, char* flags, FILE* img, BPB* b, unsigned int current_cluster, file_table* table, char* img_name);
-void close(char* filename, file_table* table);
+void open(char* filename, char* flags, blkdev* img, BPB* b, unsigned int cwd, file_table* table, char* img_name);
+void close(char* filename, blkdev* img, BPB* b, file_table* table);
 void lsof(file_table* table);
-void lseek(char* filename, int offset, file_table* table);
-void read(char* filename, int size, FILE* img, BPB* b, file_table* table, unsigned int current_cluster);
+void lseek(char* filename, off_t offset, blkdev* img, BPB* b, file_table* table);
+#define READ_TEXT   0       // the bytes, then a newline
+#define READ_HEX    1       // hexdump: offset, hex bytes and printable text
+#define READ_RAW    2       // the bytes exactly, nothing added
+void read(char* filename, off_t size, int mode, blkdev* img, BPB* b, file_table* table);
 
 // part 5: mv and write
-void write_file(char* filename, char* string, FILE* img, BPB* b, file_table* table, unsigned int current_cluster);
-void mv(char* src, char* dest, FILE* img, BPB* b, unsigned int current_cluster, file_table* table);
+void write_file(char* filename, char* string, blkdev* img, BPB* b, file_table* table);
+int write_flush(blkdev* img, BPB* b, file_table* f);
+void mv(char* src_path, char* dest_path, blkdev* img, BPB* b, unsigned int cwd, file_table* table);
 
 // part 6: rm and rmdir
-void rm(char* filename, FILE* img, BPB* b, unsigned int current_cluster, file_table* table);
-void rmdir_cmd(char* dirname, FILE* img, BPB* b, unsigned int current_cluster, file_table* table);
+void rm(char* path, blkdev* img, BPB* b, unsigned int cwd, file_table* table);
+void rmdir_cmd(char* path, blkdev* img, BPB* b, unsigned int cwd, file_table* table);
+
+// copy host files in and out of the image
+#define IO_BUF_BYTES    (1 << 20)   // host transfer buffer (whole clusters)
+void import_file(char* host_path, char* path, blkdev* img, BPB* b, unsigned int cwd);
+void export_file(char* path, char* host_path, blkdev* img, BPB* b, unsigned int cwd, file_table* table);
+
+// write back cached FAT and blocks
+void sync_image(blkdev* img, BPB* b, file_table* table);
@@ -2,7 +2,13 @@
 
 #include "lexer.h"
 #include "shell.h"
+#include "blkio.h"
 #include "file_ops.h"
+#include "fat.h"
+#include "cache.h"
+#include "dirscan.h"
+#include "dirindex.h"
+#include "dcache.h"
 #include "commands.h"
 
 #include <stdio.h>
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "file_ops.h"
+
+// directory entry (dentry) cache for path walks
+//
+// maps (parent directory cluster, raw 11-byte name) to the first cluster
+// of the subdirectory with that name. every dentry also serves as the
+// parent link of the directory it names, so ".." is answered from memory
+// as well. only directories are cached: their first cluster never changes,
+// so a dentry stays valid until the directory is renamed, moved or
+// removed, which call dcache_forget(). when the table is full it is
+// emptied and refilled by later walks.
+//
+// path_walk() and path_split() resolve absolute ("/A/B") and relative
+// ("B/../C") paths one component at a time, going to the directory index
+// (and the disk) only for components that are not cached yet. dir_within()
+// climbs the same parent links to tell whether one directory is inside
+// another.
+#define DCACHE_ENTRIES      512
+#define DCACHE_BUCKETS      256     // power of two
+#define PATH_NAME_MAX       256     // size of path_split()'s last component
+
+unsigned int dcache_lookup(unsigned int parent, const unsigned char *name);
+unsigned int dcache_parent(unsigned int cluster);
+void dcache_add(unsigned int parent, const unsigned char *name, unsigned int cluster);
+void dcache_forget(unsigned int cluster);
+void dcache_clear(void);
+
+int dir_within(blkdev *img, BPB *b, unsigned int dir, unsigned int ancestor);
+unsigned int path_walk(blkdev *img, BPB *b, unsigned int cwd, const char *path);
+int path_split(blkdev *img, BPB *b, unsigned int cwd, const char *path,
+               unsigned int *dir, char *last);
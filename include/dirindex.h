@@ -0,0 +1,33 @@
+#pragma once
+
+#include "file_ops.h"
+
+// in-memory name index for directories
+//
+// the first lookup in a directory scans its cluster chain once and builds
+// a hash table from the raw 11-byte name to the byte offset of the entry
+// in the image. later lookups in that directory are a hash probe plus one
+// 32-byte read of the entry (normally a block cache hit).
+//
+// up to DIRINDEX_DIRS directories are indexed at a time; the least
+// recently used index is dropped to make room. commands that add, rename
+// or delete entries call dirindex_add()/dirindex_remove() so an existing
+// index never has to be rebuilt; both are no-ops for directories that are
+// not indexed. dirindex_drop() forgets a directory whose clusters are
+// freed (rmdir).
+//
+// an index also keeps slot hints for inserts: the clusters of the chain,
+// the position of the end-of-entries marker, the lowest position that may
+// be free and the number of deleted slots before the marker. they are
+// kept current by dirindex_add()/dirindex_remove()/dirindex_grow(), so
+// dirindex_free_slot() normally answers without touching the disk; only
+// reusing a deleted slot reads forward from the lowest free hint.
+#define DIRINDEX_DIRS       16      // directories indexed at once
+
+off_t dirindex_lookup(blkdev *img, BPB *b, unsigned int dir_cluster, const unsigned char *name);
+void dirindex_add(unsigned int dir_cluster, const unsigned char *name, off_t offset);
+void dirindex_remove(unsigned int dir_cluster, const unsigned char *name);
+off_t dirindex_free_slot(blkdev *img, BPB *b, unsigned int dir_cluster, unsigned int *tail);
+void dirindex_grow(BPB *b, unsigned int dir_cluster, unsigned int cluster);
+void dirindex_drop(unsigned int dir_cluster);
+void dirindex_clear(void);
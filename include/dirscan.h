@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include "file_ops.h"
+
+// directory cluster scanner
+//
+// classifies a cluster's worth of dir entries in one call instead of
+// branching on name[0] and attr entry by entry. the result is two bitmaps
+// with one bit per entry (word i covers entries 64*i .. 64*i+63):
+//  - live: a real name (not deleted, not a long-name part, not the volume
+//    label) before the end-of-directory marker
+//  - spare: a slot that can take a new entry (deleted, the end marker, or
+//    anything after it)
+// dirscan_find() looks for an encoded 11-byte name among the live entries.
+//
+// x86 builds that target SSE2 (all x86-64 builds) have SSE2 (4 entries
+// per step) and AVX2 (8 entries per step, chosen at run time when the CPU
+// has it) versions next to the plain C one. dirscan_init() picks one by
+// name ("auto", "avx2", "sse2", "scalar"); the default is auto.
+#define DIRSCAN_WORDS(n)    (((n) + 63) / 64)
+
+int dirscan_init(const char *mode);
+const char *dirscan_mode(void);
+int dirscan_classify(const dir_entry *entries, int n, uint64_t *live, uint64_t *spare);
+int dirscan_find(const dir_entry *entries, int n, const unsigned char *key, int *end);
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include "file_ops.h"
+
+// FAT32 entry values (only the low 28 bits are meaningful)
+#define FAT_ENTRY_MASK  0x0FFFFFFF
+#define FAT_FREE        0x00000000
+#define FAT_EOC         0x0FFFFFF8      // >= this means end of chain
+
+// in-memory copy of FAT1, loaded once at mount time
+//
+// write-back policy: fat_set() only changes the in-memory table and marks
+// the FAT sector holding the entry dirty. fat_flush() copies every dirty
+// sector into the block cache for all NumFATs copies; it is called by
+// sync_image() (sync, close and exit), which then writes the cache back.
+//
+// a free-cluster bitmap is built next to the table at load time and kept
+// in sync by fat_set(). fat_alloc_cluster() and fat_extend_chain() are
+// the only ways to get new clusters.
+int fat_load(blkdev *img, BPB *b);
+void fat_unload(void);
+unsigned int fat_get(unsigned int cluster);
+void fat_set(unsigned int cluster, unsigned int value);
+void fat_free_chain(unsigned int cluster);
+unsigned int fat_alloc_cluster(void);
+unsigned int fat_extend_chain(unsigned int tail, unsigned int count);
+unsigned int fat_free_count(void);
+void fat_flush(blkdev *img, BPB *b);
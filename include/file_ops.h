@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdio.h>
+#include <stdint.h>
+#include "blkio.h"
 
 typedef struct __attribute__((packed)){
     // these are taken from the Boot Sector section of the
@@ -51,6 +53,16 @@ typedef struct __attribute__((packed)){
 
     // byes 510 and 511 contain "0xAA55"
     // BPB is 90 bytes long
+
+    // mount geometry: worked out once from the fields above by
+    // mount_geometry() (not part of the on-disk BPB)
+    off_t fat_start;                 // byte offset of the first FAT
+    off_t fat_bytes;                 // size of one FAT
+    off_t data_start;                // byte offset of cluster 2
+    unsigned int cluster_size;      // bytes per cluster
+    unsigned int cluster_count;     // clusters in the data region
+    unsigned char sec_shift;        // log2(BytesPerSec)
+    unsigned char clus_shift;       // log2(cluster_size)
 } BPB;
 
 typedef struct __attribute__((packed)) {
@@ -77,27 +89,86 @@ typedef struct __attribute__((packed)) {
 #define ATTR_ARCHIVE    0x20
 #define ATTR_LONG_NAME  0x0F
 
+// bytes prefetched by a sequential read
+#define READAHEAD_BYTES 65536
+
+// cursor over the live entries of a directory chain (see dir_iter_open).
+// holds one cluster at a time, so walking a directory of any size takes
+// constant memory
+typedef struct {
+    blkdev *img;
+    BPB *b;
+    unsigned int cluster;       // cluster being walked, 0 when finished
+    off_t cluster_start;         // its byte offset in the image
+    int max_entries;            // entries per cluster
+    dir_entry *buf;             // cluster buffer (unused when mapped)
+    dir_entry *entries;         // entries of the current cluster
+    uint64_t *live;             // dirscan bitmaps for the current cluster
+    uint64_t *spare;
+    int word;                   // live word being walked
+    uint64_t bits;              // its remaining bits
+    int at_end;                 // end marker seen in the current cluster
+} dir_iter;
+
+// run of physically contiguous clusters in a file's chain
+typedef struct{
+    unsigned int logical;       // index of the run's first cluster within the file
+    unsigned int physical;      // cluster number of the run's first cluster
+    unsigned int count;         // clusters in the run
+} extent;
+
 typedef struct{
     char filename[256];         // name of file
     char mode;                  // what command 'r', 'w', 'rw', 'wr'
-    int offset;                 // current position in file
-    FILE *fp;                   // file pointer when open()
+    off_t offset;               // current position in file
+    blkdev *fp;                 // image device when open()
     char path[512];             // abs path to file
     int index;                  // index in the data structure
-    int filesize;               // size of file
+    uint32_t filesize;          // size of file (FAT32 caps it at 4 GB - 1)
     int isopen;                 // 1 for open 0 for closed
+    unsigned int dir_cluster;   // first cluster of the directory holding the file
+    off_t entry_offset;          // byte offset of the file's dir entry in the image
+    unsigned int first_cluster; // file's first cluster (0 if it has no data yet)
+    extent *extents;            // cluster chain as runs, sorted by logical
+    int extent_count;           // runs in extents
+    int extent_cap;             // allocated size of extents
+    unsigned int nclusters;     // clusters covered by extents
+    int extents_loaded;         // 1 once extents has been built from the chain
+    int cur_extent;             // cursor: run holding the last cluster looked up
+    unsigned int cur_logical;   // cursor: last logical cluster looked up
+    unsigned int cur_physical;  // cursor: its physical cluster
+    off_t seq_offset;           // where the last read stopped
+    unsigned char *ra_buf;      // read-ahead buffer (READAHEAD_BYTES)
+    unsigned int ra_logical;    // first logical cluster held in ra_buf
+    unsigned int ra_count;      // clusters held in ra_buf (0 = empty)
+    unsigned char *wb_buf;      // write buffer (one cluster), NULL until the first write
+    off_t wb_offset;            // file offset of wb_buf[0]
+    unsigned int wb_len;        // bytes waiting in wb_buf (0 = empty)
 } file_table;
 
 extern file_table table[10];
 
-void read_boot_sector(FILE* img, unsigned char* boot_sector);
+void read_boot_sector(blkdev* img, unsigned char* boot_sector);
 void parse_boot_sector(BPB *b, unsigned char* boot_sector);
-dir_entry* read_dir(FILE* img, BPB *b, unsigned int cluster, int *entry_count);
-dir_entry* read_dir_chain(FILE* img, BPB *b, unsigned int cluster, int *entry_count);
-unsigned int get_cluster_offset(BPB *b, unsigned int cluster);
-unsigned int get_next_cluster(FILE* img, BPB *b, unsigned int cluster);
-dir_entry* find_entry_in_cluster(FILE* img, BPB *b, unsigned int cluster, char* name);
+int dir_iter_open(dir_iter *it, blkdev* img, BPB *b, unsigned int cluster);
+dir_entry* dir_iter_next(dir_iter *it, off_t *offset);
+void dir_iter_close(dir_iter *it);
+int mount_geometry(BPB *b);
+off_t get_cluster_offset(BPB *b, unsigned int cluster);
+dir_entry* cluster_entries(blkdev* img, BPB *b, off_t offset, dir_entry *buf);
+unsigned int get_next_cluster(blkdev* img, BPB *b, unsigned int cluster);
+int find_entry_in_chain(blkdev* img, BPB *b, unsigned int cluster, const char* name,
+                        dir_entry* out, off_t* offset);
 unsigned int get_root_cluster(BPB *b);
 int is_directory(dir_entry *entry);
 int is_longname(dir_entry *entry);
-char* trim_filename(char *filename, int name_len);
+int name_encode(const char *name, unsigned char *key);
+int name_matches(const dir_entry *entry, const unsigned char *key);
+void name_decode(const unsigned char *raw, char *out);
+void extent_build(blkdev* img, BPB *b, file_table *f, unsigned int first_cluster);
+int extent_append(blkdev* img, BPB *b, file_table *f, unsigned int cluster);
+unsigned int extent_lookup(file_table *f, unsigned int logical);
+unsigned int extent_tail(file_table *f);
+void extent_clear(file_table *f);
+int file_segments(BPB *b, file_table *f, off_t offset, void *buf, int len, blk_seg **out);
+int file_read_at(blkdev* img, BPB *b, file_table *f, off_t offset, unsigned char *buf, int len);
@@ -5,4 +5,5 @@ extern char current_path[256];
 void print_image_name(char* img_name);
 void print_path(char* current_path);
 void init_path(void);
+void path_apply(char *path, const char *rel);
 void update_path(char* dirname, int is_entering);
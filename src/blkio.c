@@ -0,0 +1,440 @@
+#define _GNU_SOURCE     // copy_file_range
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "blkio.h"
+
+// this file does not include common.h: the shell's commands are named
+// open/close/read/lseek, which clash with the declarations in unistd.h.
+// for the same reason the image is opened with fopen and released with
+// fclose rather than open(2)/close(2).
+
+static off_t fd_size(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    return st.st_size;
+}
+
+// ---- pread backend ----
+
+static long pread_read_at(blkdev *dev, off_t offset, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(dev->fd, (char *)buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+static long pread_write_at(blkdev *dev, off_t offset, const void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(dev->fd, (const char *)buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    if (offset + (off_t)done > dev->length) {
+        dev->length = offset + done;
+    }
+    return done;
+}
+
+// segments that follow each other in the image become one preadv/pwritev
+// with an iovec per segment, so adjacent pieces in separate buffers (e.g.
+// neighbouring cache blocks) cost one syscall. a short transfer is
+// finished segment by segment with pread/pwrite
+#define IOV_BATCH   64      // iovecs per call, well under the kernel's IOV_MAX
+
+static int vector_segs(blkdev *dev, blk_seg *segs, int n, int write) {
+    struct iovec iov[IOV_BATCH];
+    int rc = 0;
+    int i = 0;
+
+    while (i < n) {
+        // gather the run of segments contiguous with segs[i]
+        int count = 1;
+        size_t total = segs[i].len;
+        while (i + count < n && count < IOV_BATCH &&
+               segs[i + count].offset == segs[i].offset + (off_t)total) {
+            total += segs[i + count].len;
+            count++;
+        }
+        for (int k = 0; k < count; k++) {
+            iov[k].iov_base = segs[i + k].buf;
+            iov[k].iov_len = segs[i + k].len;
+        }
+
+        ssize_t got;
+        do {
+            got = write ? pwritev(dev->fd, iov, count, segs[i].offset)
+                        : preadv(dev->fd, iov, count, segs[i].offset);
+        } while (got < 0 && errno == EINTR);
+        if (got < 0) {
+            got = 0;
+        }
+
+        // hand out what was transferred, then finish the rest one by one
+        for (int k = i; k < i + count; k++) {
+            size_t part = (size_t)got < segs[k].len ? (size_t)got : segs[k].len;
+            got -= part;
+            segs[k].done = part;
+            if (part < segs[k].len) {
+                char *buf = (char *)segs[k].buf + part;
+                long more = write ? pread_write_at(dev, segs[k].offset + part, buf, segs[k].len - part)
+                                  : pread_read_at(dev, segs[k].offset + part, buf, segs[k].len - part);
+                segs[k].done += more;
+                if (segs[k].done < (long)segs[k].len) {
+                    rc = -1;
+                }
+            } else if (write && segs[k].offset + segs[k].done > dev->length) {
+                dev->length = segs[k].offset + segs[k].done;
+            }
+        }
+        i += count;
+    }
+    return rc;
+}
+
+static int pread_read_segs(blkdev *dev, blk_seg *segs, int n) {
+    return vector_segs(dev, segs, n, 0);
+}
+
+static int pread_write_segs(blkdev *dev, blk_seg *segs, int n) {
+    return vector_segs(dev, segs, n, 1);
+}
+
+static int pread_flush(blkdev *dev) {
+    // pwrite already handed the data to the kernel
+    return 0;
+}
+
+static off_t pread_size(blkdev *dev) {
+    return dev->length;
+}
+
+// ---- stdio backend ----
+
+static long stdio_read_at(blkdev *dev, off_t offset, void *buf, size_t len) {
+    if (fseeko(dev->fp, offset, SEEK_SET) != 0) {
+        return 0;
+    }
+    return fread(buf, 1, len, dev->fp);
+}
+
+static long stdio_write_at(blkdev *dev, off_t offset, const void *buf, size_t len) {
+    if (fseeko(dev->fp, offset, SEEK_SET) != 0) {
+        return 0;
+    }
+    size_t done = fwrite(buf, 1, len, dev->fp);
+    if (offset + (off_t)done > dev->length) {
+        dev->length = offset + done;
+    }
+    return done;
+}
+
+static int stdio_flush(blkdev *dev) {
+    return fflush(dev->fp);
+}
+
+// ---- mmap backend ----
+
+static long map_span(blkdev *dev, off_t offset, size_t len) {
+    if (offset < 0 || offset >= dev->length) {
+        return 0;
+    }
+    return (offset + (off_t)len > dev->length) ? dev->length - offset : (long)len;
+}
+
+static long mmap_read_at(blkdev *dev, off_t offset, void *buf, size_t len) {
+    long n = map_span(dev, offset, len);
+    memcpy(buf, dev->map + offset, n);
+    return n;
+}
+
+// buf may point into the mapping itself (e.g. the FAT used in place);
+// then nothing moves and the range is only marked dirty
+static long mmap_write_at(blkdev *dev, off_t offset, const void *buf, size_t len) {
+    long n = map_span(dev, offset, len);
+    if (n == 0) {
+        return 0;
+    }
+    if (buf != dev->map + offset) {
+        memmove(dev->map + offset, buf, n);
+    }
+    for (off_t p = offset / dev->page_size; p <= (offset + n - 1) / dev->page_size; p++) {
+        dev->dirty[p >> 6] |= (uint64_t)1 << (p & 63);
+    }
+    return n;
+}
+
+// msync each run of dirty pages, then forget them
+static int mmap_flush(blkdev *dev) {
+    int rc = 0;
+    long p = 0;
+    while (p < dev->pages) {
+        if (!((dev->dirty[p >> 6] >> (p & 63)) & 1)) {
+            p++;
+            continue;
+        }
+        long start = p;
+        while (p < dev->pages && ((dev->dirty[p >> 6] >> (p & 63)) & 1)) {
+            dev->dirty[p >> 6] &= ~((uint64_t)1 << (p & 63));
+            p++;
+        }
+        off_t from = start * dev->page_size;
+        off_t len = (p - start) * dev->page_size;
+        if (from + len > dev->length) {
+            len = dev->length - from;
+        }
+        if (msync(dev->map + from, len, MS_SYNC) != 0) {
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+static int mmap_setup(blkdev *dev) {
+    if (dev->length <= 0) {
+        printf("ERROR: Could not get the size of the image.\n");
+        return -1;
+    }
+
+    void *p = mmap(NULL, dev->length, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+    if (p == MAP_FAILED) {
+        printf("ERROR: Could not map the image.\n");
+        return -1;
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    dev->page_size = page > 0 ? page : 4096;
+    dev->pages = (dev->length + dev->page_size - 1) / dev->page_size;
+    dev->dirty = (uint64_t *)calloc((dev->pages + 63) / 64, sizeof(uint64_t));
+    if (dev->dirty == NULL) {
+        printf("ERROR: Failed to allocate memory for the dirty page map.\n");
+        munmap(p, dev->length);
+        return -1;
+    }
+
+    dev->map = (unsigned char *)p;
+    return 0;
+}
+
+// ---- common ----
+
+static void use_pread(blkdev *dev) {
+    dev->name = "pread";
+    dev->read_at = pread_read_at;
+    dev->write_at = pread_write_at;
+    dev->flush = pread_flush;
+    dev->read_segs = pread_read_segs;
+    dev->write_segs = pread_write_segs;
+}
+
+// open the image with the named backend ("pread", "stdio", "mmap" or
+// "uring"). depth is the io_uring queue depth, 0 for the default
+blkdev *blk_open(const char *path, const char *backend, unsigned int depth) {
+    blkdev *dev = (blkdev *)calloc(1, sizeof(blkdev));
+    if (dev == NULL) {
+        printf("ERROR: Failed to allocate memory for the image device.\n");
+        return NULL;
+    }
+
+    // r+ = do reads and writes on the file
+    dev->fp = fopen(path, "r+");
+    if (dev->fp == NULL) {
+        free(dev);
+        return NULL;
+    }
+    dev->fd = fileno(dev->fp);
+    dev->length = fd_size(dev->fd);
+    dev->size = pread_size;
+
+    if (strcmp(backend, "pread") == 0) {
+        use_pread(dev);
+    } else if (strcmp(backend, "uring") == 0) {
+        // single reads and writes still use pread/pwrite, only segment
+        // lists go through the ring
+        use_pread(dev);
+        if (uring_attach(dev, depth > 0 ? depth : BLK_QUEUE_DEPTH) == 0) {
+            dev->name = "uring";
+        } else {
+            printf("io_uring is not available, using pread.\n");
+        }
+    } else if (strcmp(backend, "stdio") == 0) {
+        dev->name = "stdio";
+        dev->read_at = stdio_read_at;
+        dev->write_at = stdio_write_at;
+        dev->flush = stdio_flush;
+    } else if (strcmp(backend, "mmap") == 0) {
+        dev->name = "mmap";
+        dev->read_at = mmap_read_at;
+        dev->write_at = mmap_write_at;
+        dev->flush = mmap_flush;
+        if (mmap_setup(dev) != 0) {
+            fclose(dev->fp);
+            free(dev);
+            return NULL;
+        }
+    } else {
+        printf("ERROR: Unknown I/O backend %s.\n", backend);
+        fclose(dev->fp);
+        free(dev);
+        return NULL;
+    }
+
+    return dev;
+}
+
+void blk_close(blkdev *dev) {
+    if (dev == NULL) {
+        return;
+    }
+    blk_flush(dev);
+    if (dev->ring != NULL) {
+        uring_detach(dev);
+    }
+    if (dev->map != NULL) {
+        munmap(dev->map, dev->length);
+        free(dev->dirty);
+    }
+    fclose(dev->fp);
+    free(dev);
+}
+
+long blk_read_at(blkdev *dev, off_t offset, void *buf, size_t len) {
+    return dev->read_at(dev, offset, buf, len);
+}
+
+long blk_write_at(blkdev *dev, off_t offset, const void *buf, size_t len) {
+    return dev->write_at(dev, offset, buf, len);
+}
+
+// transfer a list of segments, setting done on each. returns -1 if any
+// segment came up short
+int blk_read_segs(blkdev *dev, blk_seg *segs, int n) {
+    if (dev->read_segs != NULL) {
+        return dev->read_segs(dev, segs, n);
+    }
+    int rc = 0;
+    for (int i = 0; i < n; i++) {
+        segs[i].done = dev->read_at(dev, segs[i].offset, segs[i].buf, segs[i].len);
+        if (segs[i].done != (long)segs[i].len) {
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+int blk_write_segs(blkdev *dev, blk_seg *segs, int n) {
+    if (dev->write_segs != NULL) {
+        return dev->write_segs(dev, segs, n);
+    }
+    int rc = 0;
+    for (int i = 0; i < n; i++) {
+        segs[i].done = dev->write_at(dev, segs[i].offset, segs[i].buf, segs[i].len);
+        if (segs[i].done != (long)segs[i].len) {
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+int blk_flush(blkdev *dev) {
+    return dev->flush(dev);
+}
+
+off_t blk_size(blkdev *dev) {
+    return dev->size(dev);
+}
+
+// pointer to the image at offset when it is mapped, else NULL
+unsigned char *blk_ptr(blkdev *dev, off_t offset) {
+    return dev->map != NULL ? dev->map + offset : NULL;
+}
+
+// copy len bytes of the image at offset into out_fd at out_offset. the
+// data goes from file to file inside the kernel with copy_file_range, or
+// sendfile when that is refused (e.g. across file systems on old
+// kernels); pread/pwrite through a bounce buffer is the last resort.
+// the caller must flush anything it still holds for this range first.
+// returns the bytes copied
+long blk_copy_out(blkdev *dev, off_t offset, size_t len, int out_fd, off_t out_offset) {
+    size_t done = 0;
+
+    while (done < len) {
+        off_t in = offset + done;
+        off_t out = out_offset + done;
+        ssize_t n = copy_file_range(dev->fd, &in, out_fd, &out, len - done, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+
+    // sendfile writes at the descriptor's own position
+    if (done < len && lseek(out_fd, out_offset + done, SEEK_SET) >= 0) {
+        while (done < len) {
+            off_t in = offset + done;
+            ssize_t n = sendfile(out_fd, dev->fd, &in, len - done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            done += n;
+        }
+    }
+
+    if (done < len) {
+        size_t chunk = len - done < COPY_BOUNCE_BYTES ? len - done : COPY_BOUNCE_BYTES;
+        char *buf = (char *)malloc(chunk);
+        while (buf != NULL && done < len) {
+            size_t want = len - done < chunk ? len - done : chunk;
+            long got = dev->read_at(dev, offset + done, buf, want);
+            if (got <= 0) {
+                break;
+            }
+            long put = 0;
+            while (put < got) {
+                ssize_t n = pwrite(out_fd, buf + put, got - put, out_offset + done + put);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    break;
+                }
+                put += n;
+            }
+            done += put;
+            if (put < got) {
+                break;
+            }
+        }
+        free(buf);
+    }
+    return done;
+}
@@ -0,0 +1,215 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include "blkio.h"
+
+// io_uring backend for segment lists. like blkio.c this file does not
+// include common.h (unistd.h clashes with the shell's open/close/read).
+// there is no liburing here, so the rings are set up with the raw
+// syscalls and mapped by hand.
+
+typedef struct {
+    int fd;
+    unsigned int entries;
+
+    // submission ring
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+
+    // completion ring
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring, *cq_ring;
+    size_t sq_len, cq_len, sqes_len;
+} uring;
+
+static long ring_setup(unsigned int entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static long ring_enter(int fd, unsigned int submit, unsigned int wait, unsigned int flags) {
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int uring_read_segs(blkdev *dev, blk_seg *segs, int n);
+static int uring_write_segs(blkdev *dev, blk_seg *segs, int n);
+
+static void ring_unmap(uring *r) {
+    if (r->sqes != NULL && r->sqes != MAP_FAILED) {
+        munmap(r->sqes, r->sqes_len);
+    }
+    if (r->cq_ring != NULL && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_len);
+    }
+    if (r->sq_ring != NULL && r->sq_ring != MAP_FAILED) {
+        munmap(r->sq_ring, r->sq_len);
+    }
+}
+
+// create a ring with room for depth requests and use it for the
+// device's segment lists. returns -1 if the kernel does not have io_uring
+int uring_attach(blkdev *dev, unsigned int depth) {
+    uring *r = (uring *)calloc(1, sizeof(uring));
+    if (r == NULL) {
+        return -1;
+    }
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    long fd = ring_setup(depth, &p);
+    if (fd < 0) {
+        free(r);
+        return -1;
+    }
+    r->fd = (int)fd;
+    r->entries = p.sq_entries;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        // both rings share one mapping
+        if (r->cq_len > r->sq_len) {
+            r->sq_len = r->cq_len;
+        }
+        r->cq_len = r->sq_len;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      r->fd, IORING_OFF_SQ_RING);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          r->fd, IORING_OFF_CQ_RING);
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+
+    if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        ring_unmap(r);
+        syscall(__NR_close, r->fd);
+        free(r);
+        return -1;
+    }
+
+    unsigned char *sq = (unsigned char *)r->sq_ring;
+    r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+
+    unsigned char *cq = (unsigned char *)r->cq_ring;
+    r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    dev->ring = r;
+    dev->read_segs = uring_read_segs;
+    dev->write_segs = uring_write_segs;
+    return 0;
+}
+
+void uring_detach(blkdev *dev) {
+    uring *r = (uring *)dev->ring;
+    if (r == NULL) {
+        return;
+    }
+    ring_unmap(r);
+    // the descriptor is closed with the raw syscall, close() is a shell command
+    syscall(__NR_close, r->fd);
+    free(r);
+    dev->ring = NULL;
+    dev->read_segs = NULL;
+    dev->write_segs = NULL;
+}
+
+// keep up to entries requests in flight until every segment has completed.
+// segments that fail or come back short are finished with read_at/write_at
+static int ring_transfer(blkdev *dev, blk_seg *segs, int n, int write) {
+    uring *r = (uring *)dev->ring;
+    int next = 0;           // next segment to queue
+    unsigned int inflight = 0;
+    int completed = 0;
+    int rc = 0;
+
+    while (completed < n) {
+        // fill the submission ring
+        unsigned int tail = *r->sq_tail;
+        while (next < n && inflight < r->entries) {
+            unsigned int slot = tail & *r->sq_mask;
+            struct io_uring_sqe *sqe = &r->sqes[slot];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = dev->fd;
+            sqe->addr = (unsigned long)segs[next].buf;
+            sqe->len = segs[next].len;
+            sqe->off = segs[next].offset;
+            sqe->user_data = next;
+            r->sq_array[slot] = slot;
+            tail++;
+            inflight++;
+            next++;
+        }
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+        unsigned int pending = tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (ring_enter(r->fd, pending, 1, IORING_ENTER_GETEVENTS) < 0 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY && pending == inflight) {
+            // nothing reached the kernel: take the requests back and do
+            // the rest synchronously
+            __atomic_store_n(r->sq_tail, tail - pending, __ATOMIC_RELEASE);
+            next -= pending;
+            break;
+        }
+
+        // reap completions
+        unsigned int head = *r->cq_head;
+        unsigned int ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != ctail) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            segs[cqe->user_data].done = cqe->res > 0 ? cqe->res : 0;
+            head++;
+            inflight--;
+            completed++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // anything short (or never queued) is finished one call at a time
+    for (int i = 0; i < n; i++) {
+        if (i >= next) {
+            segs[i].done = 0;
+        }
+        if (segs[i].done < (long)segs[i].len) {
+            char *buf = (char *)segs[i].buf + segs[i].done;
+            size_t rest = segs[i].len - segs[i].done;
+            long got = write ? dev->write_at(dev, segs[i].offset + segs[i].done, buf, rest)
+                             : dev->read_at(dev, segs[i].offset + segs[i].done, buf, rest);
+            segs[i].done += got;
+            if (segs[i].done < (long)segs[i].len) {
+                rc = -1;
+            }
+        } else if (write && segs[i].offset + segs[i].done > dev->length) {
+            dev->length = segs[i].offset + segs[i].done;
+        }
+    }
+    return rc;
+}
+
+static int uring_read_segs(blkdev *dev, blk_seg *segs, int n) {
+    return ring_transfer(dev, segs, n, 0);
+}
+
+static int uring_write_segs(blkdev *dev, blk_seg *segs, int n) {
+    return ring_transfer(dev, segs, n, 1);
+}
@@ -0,0 +1,459 @@
+#include "common.h"
+
+#define HASH_BUCKETS    (CACHE_BLOCKS * 2)      // power of two
+
+typedef struct {
+    long key;               // block number
+    unsigned char *data;
+    int valid;
+    int dirty;
+    int prev, next;         // LRU list, head is most recently used
+    int hnext;              // next block in the same hash bucket
+} cache_block;
+
+static cache_block blocks[CACHE_BLOCKS];
+static int buckets[HASH_BUCKETS];
+static int lru_head = -1;
+static int lru_tail = -1;
+
+static unsigned char *block_mem = NULL;
+static long block_size = 0;
+static int block_shift = 0;     // log2(block_size)
+static off_t block_base = 0;     // image offset of block 0 (data region aligned)
+static off_t image_size = 0;
+static unsigned int dirty_count = 0;
+static unsigned int dirty_limit = CACHE_DIRTY_MAX;
+static int passthrough = 0;     // mapped device: no blocks are held
+
+// segment list handed to the device in one go (reads around the cache,
+// write-back of dirty blocks)
+static blk_seg *batch = NULL;
+static int batch_count = 0;
+static int batch_cap = 0;
+
+// block number holding an image offset (floor division, offset may be < base)
+static long block_of(off_t offset) {
+    off_t rel = offset - block_base;
+    return rel >= 0 ? rel >> block_shift : -((-rel + block_size - 1) >> block_shift);
+}
+
+static off_t block_start(long key) {
+    return block_base + key * block_size;
+}
+
+static int hash_of(long key) {
+    return (int)((unsigned long)key * 2654435761u) & (HASH_BUCKETS - 1);
+}
+
+static void lru_unlink(int i) {
+    if (blocks[i].prev >= 0) blocks[blocks[i].prev].next = blocks[i].next;
+    else lru_head = blocks[i].next;
+    if (blocks[i].next >= 0) blocks[blocks[i].next].prev = blocks[i].prev;
+    else lru_tail = blocks[i].prev;
+}
+
+static void lru_push_front(int i) {
+    blocks[i].prev = -1;
+    blocks[i].next = lru_head;
+    if (lru_head >= 0) blocks[lru_head].prev = i;
+    lru_head = i;
+    if (lru_tail < 0) lru_tail = i;
+}
+
+static void touch(int i) {
+    if (lru_head != i) {
+        lru_unlink(i);
+        lru_push_front(i);
+    }
+}
+
+static int lookup(long key) {
+    for (int i = buckets[hash_of(key)]; i >= 0; i = blocks[i].hnext) {
+        if (blocks[i].key == key) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void hash_remove(int i) {
+    int *link = &buckets[hash_of(blocks[i].key)];
+    while (*link >= 0) {
+        if (*link == i) {
+            *link = blocks[i].hnext;
+            return;
+        }
+        link = &blocks[*link].hnext;
+    }
+}
+
+// part of [start, start + len) that lies inside the image
+static void clamp(off_t *start, off_t *len, off_t *skip) {
+    *skip = 0;
+    if (*start < 0) {
+        *skip = -*start;
+        *len -= *skip;
+        *start = 0;
+    }
+    if (*start + *len > image_size) {
+        *len = image_size - *start;
+    }
+    if (*len < 0) {
+        *len = 0;
+    }
+}
+
+static void write_back(blkdev *img, int i) {
+    off_t start = block_start(blocks[i].key);
+    off_t len = block_size;
+    off_t skip;
+    clamp(&start, &len, &skip);
+
+    if (len > 0) {
+        blk_write_at(img, start, blocks[i].data + skip, len);
+    }
+    blocks[i].dirty = 0;
+    dirty_count--;
+}
+
+static void fill(blkdev *img, int i) {
+    off_t start = block_start(blocks[i].key);
+    off_t len = block_size;
+    off_t skip;
+    clamp(&start, &len, &skip);
+
+    long got = 0;
+    if (len > 0) {
+        got = blk_read_at(img, start, blocks[i].data + skip, len);
+    }
+    // anything outside the image reads as zeros
+    memset(blocks[i].data, 0, skip);
+    memset(blocks[i].data + skip + got, 0, block_size - skip - got);
+}
+
+static int batch_add(off_t offset, void *buf, size_t len) {
+    if (batch_count == batch_cap) {
+        int cap = batch_cap > 0 ? batch_cap * 2 : 64;
+        blk_seg *grown = (blk_seg *)realloc(batch, cap * sizeof(blk_seg));
+        if (grown == NULL) {
+            return -1;
+        }
+        batch = grown;
+        batch_cap = cap;
+    }
+    batch[batch_count].offset = offset;
+    batch[batch_count].buf = buf;
+    batch[batch_count].len = len;
+    batch[batch_count].done = 0;
+    batch_count++;
+    return 0;
+}
+
+// get the block for key, recycling the least recently used one on a miss.
+// the old contents are read in only when do_fill is set
+static int get_block(blkdev *img, long key, int do_fill) {
+    int i = lookup(key);
+    if (i >= 0) {
+        touch(i);
+        return i;
+    }
+
+    i = lru_tail;
+    if (blocks[i].valid) {
+        if (blocks[i].dirty) {
+            write_back(img, i);
+        }
+        hash_remove(i);
+    }
+
+    blocks[i].key = key;
+    blocks[i].valid = 1;
+    blocks[i].dirty = 0;
+    int h = hash_of(key);
+    blocks[i].hnext = buckets[h];
+    buckets[h] = i;
+
+    if (do_fill) {
+        fill(img, i);
+    }
+    touch(i);
+    return i;
+}
+
+int cache_init(blkdev *img, BPB *b, unsigned int dirty_max) {
+    image_size = blk_size(img);
+    if (blk_ptr(img, 0) != NULL) {
+        // the page cache behind the mapping does the caching
+        passthrough = 1;
+        return 0;
+    }
+
+    block_size = b->cluster_size;
+    block_shift = b->clus_shift;
+    block_base = b->data_start & (block_size - 1);
+
+    block_mem = (unsigned char *)malloc((size_t)CACHE_BLOCKS * block_size);
+    if (block_mem == NULL) {
+        printf("ERROR: Failed to allocate memory for the block cache.\n");
+        return -1;
+    }
+
+    for (int h = 0; h < HASH_BUCKETS; h++) {
+        buckets[h] = -1;
+    }
+    lru_head = lru_tail = -1;
+    for (int i = 0; i < CACHE_BLOCKS; i++) {
+        blocks[i].data = block_mem + (size_t)i * block_size;
+        blocks[i].valid = 0;
+        blocks[i].dirty = 0;
+        blocks[i].hnext = -1;
+        lru_push_front(i);
+    }
+
+    dirty_count = 0;
+    dirty_limit = dirty_max > 0 ? dirty_max : CACHE_DIRTY_MAX;
+    return 0;
+}
+
+void cache_free(void) {
+    free(block_mem);
+    free(batch);
+    block_mem = NULL;
+    batch = NULL;
+    batch_count = batch_cap = 0;
+    passthrough = 0;
+}
+
+void cache_read(blkdev *img, off_t offset, void *buf, size_t len) {
+    unsigned char *out = (unsigned char *)buf;
+
+    if (passthrough) {
+        long got = offset >= 0 ? blk_read_at(img, offset, out, len) : 0;
+        memset(out + got, 0, len - got);
+        return;
+    }
+
+    while (len > 0) {
+        long key = block_of(offset);
+        long in_block = offset - block_start(key);
+        size_t n = block_size - in_block;
+        if (n > len) {
+            n = len;
+        }
+
+        int i = lookup(key);
+        if (i >= 0) {
+            memcpy(out, blocks[i].data + in_block, n);
+            touch(i);
+        } else if (in_block == 0 && n == (size_t)block_size && offset >= 0) {
+            // whole uncached blocks: read around the cache in one go
+            while (len - n >= (size_t)block_size && lookup(key + n / block_size) < 0) {
+                n += block_size;
+            }
+            long got = blk_read_at(img, offset, out, n);
+            memset(out + got, 0, n - got);
+        } else {
+            i = get_block(img, key, 1);
+            memcpy(out, blocks[i].data + in_block, n);
+        }
+
+        out += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+// read a list of segments. cached blocks are copied out; runs of whole
+// uncached blocks from every segment are collected and read from the
+// device as one batch, so a fragmented transfer has all its pieces in
+// flight together on backends that support it
+void cache_read_segs(blkdev *img, blk_seg *segs, int n) {
+    if (passthrough) {
+        blk_read_segs(img, segs, n);
+        for (int k = 0; k < n; k++) {
+            memset((unsigned char *)segs[k].buf + segs[k].done, 0, segs[k].len - segs[k].done);
+        }
+        return;
+    }
+
+    batch_count = 0;
+    for (int k = 0; k < n; k++) {
+        unsigned char *out = (unsigned char *)segs[k].buf;
+        off_t offset = segs[k].offset;
+        size_t len = segs[k].len;
+
+        while (len > 0) {
+            long key = block_of(offset);
+            long in_block = offset - block_start(key);
+            size_t m = block_size - in_block;
+            if (m > len) {
+                m = len;
+            }
+
+            int i = lookup(key);
+            if (i >= 0) {
+                memcpy(out, blocks[i].data + in_block, m);
+                touch(i);
+            } else if (in_block == 0 && m == (size_t)block_size && offset >= 0) {
+                while (len - m >= (size_t)block_size && lookup(key + m / block_size) < 0) {
+                    m += block_size;
+                }
+                if (batch_add(offset, out, m) != 0) {
+                    cache_read(img, offset, out, m);
+                }
+            } else {
+                i = get_block(img, key, 1);
+                memcpy(out, blocks[i].data + in_block, m);
+            }
+
+            out += m;
+            offset += m;
+            len -= m;
+        }
+    }
+
+    if (batch_count > 0) {
+        blk_read_segs(img, batch, batch_count);
+        for (int k = 0; k < batch_count; k++) {
+            memset((unsigned char *)batch[k].buf + batch[k].done, 0, batch[k].len - batch[k].done);
+        }
+        batch_count = 0;
+    }
+}
+
+void cache_write(blkdev *img, off_t offset, const void *buf, size_t len) {
+    const unsigned char *in = (const unsigned char *)buf;
+
+    if (passthrough) {
+        if (offset >= 0) {
+            blk_write_at(img, offset, in, len);
+        }
+        return;
+    }
+
+    while (len > 0) {
+        long key = block_of(offset);
+        long in_block = offset - block_start(key);
+        size_t n = block_size - in_block;
+        if (n > len) {
+            n = len;
+        }
+
+        // a block that is about to be overwritten whole is not read first
+        int i = get_block(img, key, !(in_block == 0 && n == (size_t)block_size));
+        memcpy(blocks[i].data + in_block, in, n);
+        if (!blocks[i].dirty) {
+            blocks[i].dirty = 1;
+            dirty_count++;
+        }
+
+        in += n;
+        offset += n;
+        len -= n;
+    }
+
+    if (dirty_count > dirty_limit) {
+        cache_sync(img);
+    }
+}
+
+// write a list of segments. pieces that fall in cached blocks update
+// them; runs of whole uncached blocks go to the device as one batch
+// without being inserted, so streaming a large file in does not push the
+// directory and FAT blocks out of the cache
+void cache_write_segs(blkdev *img, blk_seg *segs, int n) {
+    if (passthrough) {
+        blk_write_segs(img, segs, n);
+        return;
+    }
+
+    batch_count = 0;
+    for (int k = 0; k < n; k++) {
+        unsigned char *in = (unsigned char *)segs[k].buf;
+        off_t offset = segs[k].offset;
+        size_t len = segs[k].len;
+
+        while (len > 0) {
+            long key = block_of(offset);
+            long in_block = offset - block_start(key);
+            size_t m = block_size - in_block;
+            if (m > len) {
+                m = len;
+            }
+
+            int whole = (in_block == 0 && m == (size_t)block_size);
+            if (whole && offset >= 0 && lookup(key) < 0) {
+                while (len - m >= (size_t)block_size && lookup(key + m / block_size) < 0) {
+                    m += block_size;
+                }
+                if (batch_add(offset, in, m) != 0) {
+                    blk_write_at(img, offset, in, m);
+                }
+            } else {
+                // cached, or only part of a block: through the cache
+                int i = get_block(img, key, !whole);
+                memcpy(blocks[i].data + in_block, in, m);
+                if (!blocks[i].dirty) {
+                    blocks[i].dirty = 1;
+                    dirty_count++;
+                }
+            }
+
+            in += m;
+            offset += m;
+            len -= m;
+        }
+    }
+
+    if (batch_count > 0) {
+        blk_write_segs(img, batch, batch_count);
+        batch_count = 0;
+    }
+    if (dirty_count > dirty_limit) {
+        cache_sync(img);
+    }
+}
+
+static int compare_dirty(const void *a, const void *b) {
+    long ka = blocks[*(const int *)a].key;
+    long kb = blocks[*(const int *)b].key;
+    return (ka > kb) - (ka < kb);
+}
+
+// write every dirty block back in image order as a single batch, then
+// flush the device
+void cache_sync(blkdev *img) {
+    if (!passthrough && dirty_count > 0) {
+        int order[CACHE_BLOCKS];
+        int n = 0;
+        for (int i = 0; i < CACHE_BLOCKS; i++) {
+            if (blocks[i].valid && blocks[i].dirty) {
+                order[n++] = i;
+            }
+        }
+        qsort(order, n, sizeof(int), compare_dirty);
+
+        batch_count = 0;
+        for (int k = 0; k < n; k++) {
+            off_t start = block_start(blocks[order[k]].key);
+            off_t len = block_size;
+            off_t skip;
+            clamp(&start, &len, &skip);
+            if (len > 0 && batch_add(start, blocks[order[k]].data + skip, len) != 0) {
+                write_back(img, order[k]);
+                continue;
+            }
+            blocks[order[k]].dirty = 0;
+            dirty_count--;
+        }
+        if (batch_count > 0) {
+            blk_write_segs(img, batch, batch_count);
+            batch_count = 0;
+        }
+    }
+    blk_flush(img);
+}
+
+unsigned int cache_dirty_count(void) {
+    return dirty_count;
+}
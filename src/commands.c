@@ -1,5 +1,8 @@
+#define _DEFAULT_SOURCE     // fseeko/ftello and posix_memalign for host files
+
 #include "common.h"
 #include "shell.h"
+#include <ctype.h>
 
 void info(BPB * b) {
     printf("%-12s %-12d\n", "BytesPerSec:",  b->BytesPerSec);
@@ -11,104 +14,39 @@ void info(BPB * b) {
     printf("%-12s %-12d\n", "RootClus:",    b->RootClus);
 }
 
-void ls(FILE* img, BPB* b, unsigned int cluster) {
-    int entry_count = 0;
-    // use cluster chain reading to handle multi cluster dir
-    dir_entry* entries = read_dir_chain(img, b, cluster, &entry_count);
-    
-    if (entries == NULL) {
+void ls(blkdev* img, BPB* b, unsigned int cluster) {
+    // walk the chain a cluster at a time, so any directory size
+    // takes the same memory
+    dir_iter it;
+    if (dir_iter_open(&it, img, b, cluster) != 0) {
         printf("ERROR: Could not read directory.\n");
         return;
     }
     
-    if (entry_count == 0) {
-        printf("ERROR: No entries found in directory.\n");
-        free(entries);
-        return;
+    // print all entries (volume labels are skipped by the iterator)
+    int entry_count = 0;
+    dir_entry* entry;
+    while ((entry = dir_iter_next(&it, NULL)) != NULL) {
+        // print the name without its padding
+        char name[12];
+        name_decode(entry->name, name);
+        printf("%s\n", name);
+        entry_count++;
     }
+    dir_iter_close(&it);
     
-    // print all entries
-    for (int i = 0; i < entry_count; i++) {
-        // skip volume label entries
-        if ((entries[i].attr & ATTR_VOLUME_ID) != 0) {
-            continue;
-        }
-        
-        // trim filename and print
-        char* trimmed = trim_filename((char*)entries[i].name, 11);
-        printf("%s\n", trimmed);
-        free(trimmed);
+    if (entry_count == 0) {
+        printf("ERROR: No entries found in directory.\n");
     }
-    
-    free(entries);
 }
 
-unsigned int cd(FILE* img, BPB* b, unsigned int current_cluster, char* dirname) {
-    // special case: .. (parent dir)
-    if (strcmp(dirname, "..") == 0) {
-        // look for the ".." entry to get parent cluster
-        dir_entry* entry = find_entry_in_cluster(img, b, current_cluster, "..");
-        if (entry != NULL) {
-            unsigned int parent_cluster = (entry->fstclushi << 16) | entry->fstcluslo;
-            free(entry);
-            
-            // if parent cluster is 0, we're at root - stay at root
-            if (parent_cluster == 0) {
-                parent_cluster = get_root_cluster(b);
-            }
-            
-            return parent_cluster;
-        } else {
-            // no ".." entry found, try to stay at current
-            printf("ERROR: Cannot go to parent directory.\n");
-            return 0;
-        }
-    }
-    
-    int entry_count = 0;
-    // use cluster chain reading to handle multi-cluster dir
-    dir_entry* entries = read_dir_chain(img, b, current_cluster, &entry_count);
-    
-    if (entries == NULL) {
-        printf("ERROR: Could not read directory.\n");
-        return 0;
-    }
-    
-    // search for matching dir entry
-    for (int i = 0; i < entry_count; i++) {
-        // skip volume labels
-        if ((entries[i].attr & ATTR_VOLUME_ID) != 0) {
-            continue;
-        }
-        
-        // get trimmed filename
-        char* trimmed = trim_filename((char*)entries[i].name, 11);
-        
-        // check if name matches (case-sensitive)
-        if (strcmp(trimmed, dirname) == 0) {
-            // check if it's a dir
-            if (is_directory(&entries[i])) {
-                unsigned int new_cluster = (entries[i].fstclushi << 16) | entries[i].fstcluslo;
-                free(trimmed);
-                free(entries);
-                return new_cluster;
-            } else {
-                // it's a file, not a dir
-                printf("ERROR: %s is not a directory.\n", dirname);
-                free(trimmed);
-                free(entries);
-                return 0;
-            }
-        }
-        free(trimmed);
-    }
-    
-    // dir not found
-    printf("ERROR: %s does not exist.\n", dirname);
-    free(entries);
-    return 0;
+unsigned int cd(blkdev* img, BPB* b, unsigned int current_cluster, char* dirname) {
+    // walk the path (any number of components, ".." included) through
+    // the dentry cache
+    return path_walk(img, b, current_cluster, dirname);
 }
 
+// names are stored upper case, padded to 11 bytes
 static void format_name_83(const char *name, unsigned char *dest) {
     memset(dest, ' ', 11);
     int i = 0;
@@ -118,113 +56,126 @@ static void format_name_83(const char *name, unsigned char *dest) {
     }
 }
 
-static int name_exists_in_dir(FILE *img, BPB *b, unsigned int dir_cluster, const char *name) {
-    char upper_name[12];
-    int i = 0;
-    while (name[i] && i < 11) {
-        upper_name[i] = toupper((unsigned char)name[i]);
-        i++;
-    }
-    upper_name[i] = '\0';
-
-    int entry_count = 0;
-    dir_entry *entries = read_dir_chain(img, b, dir_cluster, &entry_count);
-    
-    if (entries == NULL) {
-        return 0;
-    }
-
-    for (int j = 0; j < entry_count; j++) {
-        if ((entries[j].attr & ATTR_VOLUME_ID) != 0) {
-            continue;
-        }
-
-        char *trimmed = trim_filename((char *)entries[j].name, 11);
-        if (strcmp(trimmed, upper_name) == 0) {
-            free(trimmed);
-            free(entries);
-            return 1;
-        }
-        free(trimmed);
-    }
+static void write_cluster_local(blkdev *img, BPB *b, unsigned int cluster, unsigned char *buf) {
+    off_t offset = get_cluster_offset(b, cluster);
+    unsigned int cluster_size = b->cluster_size;
 
-    free(entries);
-    return 0;
+    cache_write(img, offset, buf, cluster_size);
 }
 
-static unsigned int find_free_cluster_local(FILE *img, BPB *b) {
-    unsigned int data_sectors = b->TotSec32 - (b->RsvdSecCnt + b->NumFATs * b->FATSz32);
-    unsigned int total_clusters = data_sectors / b->SecPerClus;
-
-    for (unsigned int cluster = 2; cluster < total_clusters + 2; cluster++) {
-        unsigned int fat_offset = b->RsvdSecCnt * b->BytesPerSec + cluster * 4;
-        
-        fseek(img, fat_offset, SEEK_SET);
-        unsigned int entry;
-        fread(&entry, sizeof(unsigned int), 1, img);
-        entry &= 0x0FFFFFFF;
-        
-        if (entry == 0) {
-            return cluster;
-        }
+// one pass over a directory chain that has no index: every cluster is
+// checked for the name and for a free (deleted or unused) slot while the
+// tail is tracked. returns the first free slot, 0 if the chain is full,
+// -1 if the name exists, -2 if out of memory
+static off_t scan_for_slot(blkdev *img, BPB *b, unsigned int dir_cluster,
+                          const unsigned char *name, unsigned int *tail) {
+    unsigned int cluster_size = b->cluster_size;
+    int max_entries = cluster_size / sizeof(dir_entry);
+    uint64_t live[DIRSCAN_WORDS(max_entries)];
+    uint64_t spare[DIRSCAN_WORDS(max_entries)];
+
+    dir_entry *buf = (dir_entry *)malloc(cluster_size);
+    if (buf == NULL) {
+        printf("Error: Memory allocation failed\n");
+        return -2;
     }
 
-    return 0;
-}
-
-
-static void write_fat_entry_local(FILE *img, BPB *b, unsigned int cluster, unsigned int value) {
-    unsigned int fat_offset = b->RsvdSecCnt * b->BytesPerSec + cluster * 4;
-
-    unsigned int existing;
-    fseek(img, fat_offset, SEEK_SET);
-    fread(&existing, sizeof(unsigned int), 1, img);
+    off_t slot = 0;
+    unsigned int cluster = dir_cluster;
+    while (cluster != 0 && cluster < FAT_EOC) {
+        *tail = cluster;
 
-    value = (existing & 0xF0000000) | (value & 0x0FFFFFFF);
+        off_t cluster_start = get_cluster_offset(b, cluster);
+        dir_entry *entries = cluster_entries(img, b, cluster_start, buf);
 
-    fseek(img, fat_offset, SEEK_SET);
-    fwrite(&value, sizeof(unsigned int), 1, img);
-    fflush(img);
-}
+        int end;
+        if (dirscan_find(entries, max_entries, name, &end) >= 0) {
+            free(buf);
+            return -1;
+        }
 
-static void write_cluster_local(FILE *img, BPB *b, unsigned int cluster, unsigned char *buf) {
-    unsigned int offset = get_cluster_offset(b, cluster);
-    unsigned int cluster_size = b->SecPerClus * b->BytesPerSec;
+        // remember the first free slot
+        if (slot == 0) {
+            dirscan_classify(entries, max_entries, live, spare);
+            for (int w = 0; w < DIRSCAN_WORDS(max_entries); w++) {
+                if (spare[w] != 0) {
+                    slot = cluster_start + (w * 64 + __builtin_ctzll(spare[w])) * sizeof(dir_entry);
+                    break;
+                }
+            }
+        }
 
-    fseek(img, offset, SEEK_SET);
-    fwrite(buf, 1, cluster_size, img);
-    fflush(img);
+        // nothing lives past the end marker
+        if (end) {
+            break;
+        }
+        cluster = get_next_cluster(img, b, cluster);
+    }
+    free(buf);
+    return slot;
 }
 
-static unsigned int find_free_dir_entry(FILE *img, BPB *b, unsigned int dir_cluster, unsigned int *out_cluster) {
-    unsigned int cluster_size = b->SecPerClus * b->BytesPerSec;
-    unsigned int current_cluster = dir_cluster;
-
-    while (current_cluster != 0 && current_cluster < 0x0FFFFFF8) {
-        unsigned int offset = get_cluster_offset(b, current_cluster);
-        int max_entries = cluster_size / sizeof(dir_entry);
+// add an entry to a directory. an indexed directory answers both the
+// duplicate check and where the entry goes from memory (dirindex free-slot
+// hints); otherwise the chain is scanned once. the directory only grows,
+// by one cluster after the tail, when no slot was found: the entry and the
+// zeros after it go out in a single cluster write. returns
+// the entry's offset, 0 if the name already exists, -1 if there is no space
+static off_t dir_insert(blkdev *img, BPB *b, unsigned int dir_cluster, dir_entry *entry) {
+    unsigned int cluster_size = b->cluster_size;
+    unsigned int tail = dir_cluster;
+    off_t slot = -1;
+
+    off_t found = dirindex_lookup(img, b, dir_cluster, entry->name);
+    if (found > 0) {
+        return 0;
+    }
+    if (found == 0) {
+        slot = dirindex_free_slot(img, b, dir_cluster, &tail);
+    }
+    if (slot < 0) {
+        slot = scan_for_slot(img, b, dir_cluster, entry->name, &tail);
+        if (slot == -1) {
+            return 0;
+        }
+        if (slot < 0) {
+            return -1;
+        }
+    }
 
-        for (int i = 0; i < max_entries; i++) {
-            unsigned int entry_offset = offset + (i * sizeof(dir_entry));
-            fseek(img, entry_offset, SEEK_SET);
-            
-            unsigned char first_byte;
-            fread(&first_byte, 1, 1, img);
+    if (slot == 0) {
+        // directory is full: link a zeroed cluster after its tail
+        unsigned int ext_cluster = fat_extend_chain(tail, 1);
+        if (ext_cluster == 0) {
+            return -1;
+        }
 
-            if (first_byte == 0x00 || first_byte == 0xE5) {
-                *out_cluster = current_cluster;
-                return entry_offset;
-            }
+        unsigned char *new_buf = calloc(1, cluster_size);
+        if (new_buf == NULL) {
+            fat_free_chain(ext_cluster);
+            fat_set(tail, FAT_EOC);
+            return -1;
         }
+        memcpy(new_buf, entry, sizeof(dir_entry));
+        write_cluster_local(img, b, ext_cluster, new_buf);
+        free(new_buf);
 
-        current_cluster = get_next_cluster(img, b, current_cluster);
+        dirindex_grow(b, dir_cluster, ext_cluster);
+        slot = get_cluster_offset(b, ext_cluster);
+    } else {
+        cache_write(img, slot, entry, sizeof(dir_entry));
     }
-
-    return 0;
+    dirindex_add(dir_cluster, entry->name, slot);
+    return slot;
 }
 
-void fat32_mkdir(FILE *img, BPB *b, unsigned int current_cluster, const char *dirname) {
-    if (dirname == NULL || strlen(dirname) == 0) {
+void fat32_mkdir(blkdev *img, BPB *b, unsigned int cwd, const char *path) {
+    unsigned int current_cluster;
+    char dirname[PATH_NAME_MAX];
+    if (path_split(img, b, cwd, path, &current_cluster, dirname) != 0) {
+        return;
+    }
+    if (strlen(dirname) == 0) {
         printf("Error: Directory name required\n");
         return;
     }
@@ -233,20 +184,33 @@ void fat32_mkdir(FILE *img, BPB *b, unsigned int current_cluster, const char *di
         return;
     }
 
-    if (name_exists_in_dir(img, b, current_cluster, dirname)) {
-        printf("Error: '%s' already exists\n", dirname);
-        return;
-    }
-
-    unsigned int new_cluster = find_free_cluster_local(img, b);
+    unsigned int new_cluster = fat_alloc_cluster();
     if (new_cluster == 0) {
         printf("Error: No free clusters available\n");
         return;
     }
 
-    write_fat_entry_local(img, b, new_cluster, 0x0FFFFFF8);
+    /* Add entry to current directory (fails if the name is taken) */
+    dir_entry new_entry;
+    memset(&new_entry, 0, sizeof(dir_entry));
+    format_name_83(dirname, new_entry.name);
+    new_entry.attr = ATTR_DIRECTORY;
+    new_entry.fstclushi = (new_cluster >> 16) & 0xFFFF;
+    new_entry.fstcluslo = new_cluster & 0xFFFF;
+    new_entry.filesize = 0;
+
+    off_t entry_offset = dir_insert(img, b, current_cluster, &new_entry);
+    if (entry_offset <= 0) {
+        if (entry_offset == 0) {
+            printf("Error: '%s' already exists\n", dirname);
+        } else {
+            printf("Error: No free clusters to extend directory\n");
+        }
+        fat_set(new_cluster, FAT_FREE);
+        return;
+    }
 
-    unsigned int cluster_size = b->SecPerClus * b->BytesPerSec;
+    unsigned int cluster_size = b->cluster_size;
     unsigned char *new_dir_buf = calloc(1, cluster_size);
     if (!new_dir_buf) {
         printf("Error: Memory allocation failed\n");
@@ -280,49 +244,17 @@ void fat32_mkdir(FILE *img, BPB *b, unsigned int current_cluster, const char *di
     write_cluster_local(img, b, new_cluster, new_dir_buf);
     free(new_dir_buf);
 
-    /* Add entry to current directory */
-    unsigned int entry_cluster;
-    unsigned int entry_offset = find_free_dir_entry(img, b, current_cluster, &entry_cluster);
-    
-    if (entry_offset == 0) {
-        unsigned int ext_cluster = find_free_cluster_local(img, b);
-        if (ext_cluster == 0) {
-            printf("Error: No free clusters to extend directory\n");
-            return;
-        }
-
-        unsigned int last_cluster = current_cluster;
-        unsigned int next = get_next_cluster(img, b, last_cluster);
-        while (next != 0 && next < 0x0FFFFFF8) {
-            last_cluster = next;
-            next = get_next_cluster(img, b, last_cluster);
-        }
-
-        write_fat_entry_local(img, b, last_cluster, ext_cluster);
-        write_fat_entry_local(img, b, ext_cluster, 0x0FFFFFF8);
-
-        unsigned char *clear_buf = calloc(1, cluster_size);
-        write_cluster_local(img, b, ext_cluster, clear_buf);
-        free(clear_buf);
+    dcache_add(current_cluster, new_entry.name, new_cluster);
+}
 
-        entry_offset = get_cluster_offset(b, ext_cluster);
+void fat32_creat(blkdev *img, BPB *b, unsigned int cwd, const char *path) {
+    unsigned int current_cluster;
+    char filename[PATH_NAME_MAX];
+    if (path_split(img, b, cwd, path, &current_cluster, filename) != 0) {
+        return;
     }
 
-    dir_entry new_entry;
-    memset(&new_entry, 0, sizeof(dir_entry));
-    format_name_83(dirname, new_entry.name);
-    new_entry.attr = ATTR_DIRECTORY;
-    new_entry.fstclushi = (new_cluster >> 16) & 0xFFFF;
-    new_entry.fstcluslo = new_cluster & 0xFFFF;
-    new_entry.filesize = 0;
-
-    fseek(img, entry_offset, SEEK_SET);
-    fwrite(&new_entry, sizeof(dir_entry), 1, img);
-    fflush(img);
-}
-
-void fat32_creat(FILE *img, BPB *b, unsigned int current_cluster, const char *filename) {
-    if (filename == NULL || strlen(filename) == 0) {
+    if (strlen(filename) == 0) {
         printf("Error: Filename required\n");
         return;
     }
@@ -331,39 +263,6 @@ void fat32_creat(FILE *img, BPB *b, unsigned int current_cluster, const char *fi
         return;
     }
 
-    if (name_exists_in_dir(img, b, current_cluster, filename)) {
-        printf("Error: '%s' already exists\n", filename);
-        return;
-    }
-
-    unsigned int cluster_size = b->SecPerClus * b->BytesPerSec;
-    unsigned int entry_cluster;
-    unsigned int entry_offset = find_free_dir_entry(img, b, current_cluster, &entry_cluster);
-    
-    if (entry_offset == 0) {
-        unsigned int ext_cluster = find_free_cluster_local(img, b);
-        if (ext_cluster == 0) {
-            printf("Error: No free clusters to extend directory\n");
-            return;
-        }
-
-        unsigned int last_cluster = current_cluster;
-        unsigned int next = get_next_cluster(img, b, last_cluster);
-        while (next != 0 && next < 0x0FFFFFF8) {
-            last_cluster = next;
-            next = get_next_cluster(img, b, last_cluster);
-        }
-
-        write_fat_entry_local(img, b, last_cluster, ext_cluster);
-        write_fat_entry_local(img, b, ext_cluster, 0x0FFFFFF8);
-
-        unsigned char *clear_buf = calloc(1, cluster_size);
-        write_cluster_local(img, b, ext_cluster, clear_buf);
-        free(clear_buf);
-
-        entry_offset = get_cluster_offset(b, ext_cluster);
-    }
-
     dir_entry new_entry;
     memset(&new_entry, 0, sizeof(dir_entry));
     format_name_83(filename, new_entry.name);
@@ -372,13 +271,16 @@ void fat32_creat(FILE *img, BPB *b, unsigned int current_cluster, const char *fi
     new_entry.fstcluslo = 0;
     new_entry.filesize = 0;
 
-    fseek(img, entry_offset, SEEK_SET);
-    fwrite(&new_entry, sizeof(dir_entry), 1, img);
-    fflush(img);
+    off_t entry_offset = dir_insert(img, b, current_cluster, &new_entry);
+    if (entry_offset == 0) {
+        printf("Error: '%s' already exists\n", filename);
+    } else if (entry_offset < 0) {
+        printf("Error: No free clusters to extend directory\n");
+    }
 }
 
 
-void open(char* filename, char* flags, FILE* img, BPB* b, unsigned int current_cluster, file_table* table, char* img_name){
+void open(char* filename, char* flags, blkdev* img, BPB* b, unsigned int cwd, file_table* table, char* img_name){
 
     // check for invalid flag input
     if (strcmp(flags, "-r") != 0 && strcmp(flags, "-w") != 0 && 
@@ -387,43 +289,30 @@ void open(char* filename, char* flags, FILE* img, BPB* b, unsigned int current_c
         printf("Error: invalid flags\n");
         return;
     }
-    // check if file is open in filetable
+    // filename may be a path: find the directory that holds the file
+    unsigned int current_cluster;
+    char name[PATH_NAME_MAX];
+    if (path_split(img, b, cwd, filename, &current_cluster, name) != 0) {
+        return;
+    }
+    dir_entry entry;
+    off_t entry_offset = 0;
+    if (!find_entry_in_chain(img, b, current_cluster, name, &entry, &entry_offset)){
+        printf("File doesnt exist\n");
+        return;
+    }
+
+    // check if file is open in filetable (under any path)
     for(int i = 0; i < 10; i++){
-        if(table[i].isopen == 1 && strcmp(table[i].filename, filename) == 0){
+        if(table[i].isopen == 1 && table[i].entry_offset == entry_offset){
             printf("Error, file already open");
             return;
         }
     }
-    int entry_count = 0;
-    dir_entry* temp_entry = read_dir_chain(img, b, current_cluster, &entry_count);
-    if(temp_entry == NULL){ 
-        printf("Error: cannot read directory\n");
-        return; 
-    }
-    dir_entry* entry = NULL;
-    for (int i = 0; i < entry_count; i++) {
-        if (is_longname(&temp_entry[i])) {
-            continue;
-        }
-        char* trimmed = trim_filename((char*)temp_entry[i].name, 11);
-        if (strcmp(trimmed, filename) == 0) {
-            entry = &temp_entry[i];
-            free(trimmed);
-            break;
-        }
-        free(trimmed);
-    }
-
-    if (entry == NULL){
-        printf("File doesnt exist\n");
-        free(temp_entry);
-        return;
-    }
 
      // check if its a dir
-    if(is_directory(entry)){
+    if(is_directory(&entry)){
         printf("Error: %s is a directory\n", filename);
-        free(entry);
         return;
     }
     // finding lowest file index then populating it
@@ -439,9 +328,19 @@ void open(char* filename, char* flags, FILE* img, BPB* b, unsigned int current_c
         return;
     }
     strcpy(table[index].filename, filename);
+    // path of the directory holding the file
+    char dir_path[256];
+    strcpy(dir_path, current_path);
+    if (strchr(filename, '/') != NULL) {
+        char *slash = strrchr(filename, '/');
+        char rel[256];
+        snprintf(rel, sizeof(rel), "%.*s", (int)(slash - filename) + 1, filename);
+        path_apply(dir_path, rel);
+    }
+
     char path[512];
     strcpy(path, img_name);
-    strcat(path, current_path);
+    strcat(path, dir_path);
     int path_len = strlen(path);
     if(path_len > 0 && path[path_len - 1] == '/'){
         path[path_len - 1] = '\0';
@@ -457,17 +356,24 @@ void open(char* filename, char* flags, FILE* img, BPB* b, unsigned int current_c
     }
 
     table[index].offset = 0;
-    table[index].filesize = entry->filesize;
+    table[index].filesize = entry.filesize;
+    extent_clear(&table[index]);        // built on first read/write
+    table[index].seq_offset = 0;
+    table[index].wb_len = 0;
     table[index].fp = img;
     table[index].index = index;
     table[index].isopen = 1;
+
+    // remember where the file lives so read/write never search for it again
+    table[index].dir_cluster = current_cluster;
+    table[index].entry_offset = entry_offset;
+    table[index].first_cluster = (entry.fstclushi << 16) | entry.fstcluslo;
     
     printf("Opened \n");
-    free(temp_entry);
 
 }
 
-void close(char* filename, file_table* table){
+void close(char* filename, blkdev* img, BPB* b, file_table* table){
 
     int index = -1;
     for(int i = 0; i < 10; i++){
@@ -481,6 +387,15 @@ void close(char* filename, file_table* table){
         return;
     }
 
+    // the file is closed either way: a failed flush has already dropped
+    // the buffered bytes
+    int flushed = write_flush(img, b, &table[index]);
+    if (flushed != 0) {
+        printf("Error: the last writes to %s were lost\n", filename);
+    }
+    free(table[index].wb_buf);
+    table[index].wb_buf = NULL;
+
     memset(table[index].filename, 0 , 256);
     memset(table[index].path, 0 , 512);
     table[index].mode = 0;
@@ -489,8 +404,16 @@ void close(char* filename, file_table* table){
     table[index].fp = NULL;
     table[index].index = index;
     table[index].isopen = 0;
+    extent_clear(&table[index]);
+    free(table[index].ra_buf);
+    table[index].ra_buf = NULL;
 
-    printf("Closed \n");
+    // make the file's data and size durable
+    sync_image(img, b, table);
+
+    if (flushed == 0) {
+        printf("Closed \n");
+    }
 }
 
 void lsof(file_table* table){
@@ -523,17 +446,17 @@ void lsof(file_table* table){
                 strcpy(mode_str, "-rw");
             }
             
-            printf("%-6d %-12s %-6s %-8d %s\n", 
+            printf("%-6d %-12s %-6s %-8lld %s\n", 
                    table[i].index, 
                    table[i].filename, 
                    mode_str, 
-                   table[i].offset, 
+                   (long long)table[i].offset, 
                    table[i].path);
         }
     }
 }
 
-void lseek(char* filename, int offset, file_table* table) {
+void lseek(char* filename, off_t offset, blkdev* img, BPB* b, file_table* table) {
     
     int index = -1;
     for(int i = 0; i < 10; i++){
@@ -547,6 +470,9 @@ void lseek(char* filename, int offset, file_table* table) {
         return;
     }
 
+    // buffered writes count towards the size
+    write_flush(img, b, &table[index]);
+
     if(offset > table[index].filesize) {
         printf("Error: offset larger than file size\n");
         table[index].offset = table[index].filesize;
@@ -560,7 +486,27 @@ void lseek(char* filename, int offset, file_table* table) {
     table[index].offset = offset;
 }
 
-void read(char* filename, int size, FILE* img, BPB* b, file_table* table, unsigned int current_cluster){
+// one hexdump line: file offset, up to 16 bytes in hex, then as text
+static void hex_line(off_t offset, const unsigned char *p, int n) {
+    printf("%08llx  ", (long long)offset);
+    for (int i = 0; i < 16; i++) {
+        if (i < n) {
+            printf("%02x ", p[i]);
+        } else {
+            printf("   ");
+        }
+        if (i == 7) {
+            printf(" ");
+        }
+    }
+    printf(" |");
+    for (int i = 0; i < n; i++) {
+        putchar(isprint(p[i]) ? p[i] : '.');
+    }
+    printf("|\n");
+}
+
+void read(char* filename, off_t size, int mode, blkdev* img, BPB* b, file_table* table){
     
     // find file in table and check if opened for reading
     int index = -1;
@@ -582,9 +528,14 @@ void read(char* filename, int size, FILE* img, BPB* b, file_table* table, unsign
         return;
     }
     
+    // a handle open for both reads its own buffered writes
+    if(write_flush(img, b, &table[index]) != 0){
+        return;
+    }
+    
     // get file info from table
-    int offset = table[index].offset;
-    int filesize = table[index].filesize;
+    off_t offset = table[index].offset;
+    off_t filesize = table[index].filesize;
     
     // check if already at end of file
     if(offset >= filesize){
@@ -593,103 +544,175 @@ void read(char* filename, int size, FILE* img, BPB* b, file_table* table, unsign
     }
     
     // calculate how many bytes to actually read
-    int bytes_to_read = size;
-    if(offset + size > filesize){
+    off_t bytes_to_read = size;
+    if(size < 0 || offset + size > filesize){
         bytes_to_read = filesize - offset;
     }
     
-    // find the file's first cluster from directory
-    int entry_count = 0;
-    dir_entry* entries = read_dir_chain(img, b, current_cluster, &entry_count);
-    if(entries == NULL){
-        printf("Error: could not read directory\n");
+    // get files first cluster (recorded by open)
+    unsigned int file_cluster = table[index].first_cluster;
+    
+    // map the chain once per open, then seek with a lookup
+    if(!table[index].extents_loaded){
+        extent_build(img, b, &table[index], file_cluster);
+    }
+    
+    if(extent_lookup(&table[index], offset >> b->clus_shift) == 0){
+        printf("Error: offset beyond file data\n");
         return;
     }
     
-    dir_entry* file_entry = NULL;
-    for(int i = 0; i < entry_count; i++){
-        if(is_longname(&entries[i])) continue;
-        char* trimmed = trim_filename((char*)entries[i].name, 11);
-        if(strcmp(trimmed, filename) == 0){
-            file_entry = &entries[i];
-            free(trimmed);
+    // stream the data a cluster at a time through one buffer that is kept
+    // between calls (sequential reads continue from the handle's cursor and
+    // are served from its read-ahead buffer)
+    static unsigned char* buffer = NULL;
+    static unsigned int buffer_size = 0;
+    if(buffer_size < b->cluster_size){
+        free(buffer);
+        buffer = malloc(b->cluster_size);
+        buffer_size = buffer ? b->cluster_size : 0;
+        if(buffer == NULL){
+            printf("Error: memory allocation failed\n");
+            return;
+        }
+    }
+
+    off_t bytes_read = 0;
+    while(bytes_read < bytes_to_read){
+        // the first chunk ends on a cluster boundary, the rest are whole clusters
+        off_t pos = offset + bytes_read;
+        off_t chunk = b->cluster_size - (pos & (b->cluster_size - 1));
+        if(chunk > bytes_to_read - bytes_read){
+            chunk = bytes_to_read - bytes_read;
+        }
+        int got = file_read_at(img, b, &table[index], pos, buffer, chunk);
+        if(got <= 0){
+            break;
+        }
+
+        if(mode == READ_HEX){
+            for(int i = 0; i < got; i += 16){
+                hex_line(pos + i, buffer + i, got - i < 16 ? got - i : 16);
+            }
+        } else {
+            fwrite(buffer, 1, got, stdout);
+        }
+        bytes_read += got;
+        if(got < chunk){
             break;
         }
-        free(trimmed);
     }
-    
-    if(file_entry == NULL){
-        printf("Error: file not found in directory\n");
-        free(entries);
-        return;
+    if(mode == READ_TEXT){
+        printf("\n");
     }
+    fflush(stdout);
     
-    // get files first cluster
-    unsigned int file_cluster = (file_entry->fstclushi << 16) | file_entry->fstcluslo;
+    // update the file offset
+    table[index].offset = offset + bytes_read;
+}
+
+
+// write out what a handle's write buffer holds: allocate any clusters the
+// file needs to reach the end of the buffered bytes, write them through
+// the block cache and update the size in the directory entry. returns -1
+// (and drops the buffered bytes) if the clusters cannot be allocated
+int write_flush(blkdev* img, BPB* b, file_table* f) {
+    if (f->wb_len == 0) {
+        return 0;
+    }
     
-    // calc cluster size
-    unsigned int cluster_size = b->BytesPerSec * b->SecPerClus;
+    off_t offset = f->wb_offset;
+    off_t filesize = f->filesize;
+    unsigned int len = f->wb_len;
+    f->wb_len = 0;
     
-    // navigate to the cluster containing the offset
-    unsigned int cluster_offset = offset;  // offset within current cluster
-    unsigned int current_file_cluster = file_cluster;
+    // Get file's first cluster (recorded by open)
+    unsigned int file_cluster = f->first_cluster;
+    unsigned int cluster_size = b->cluster_size;
     
-    // skip clusters until we reach the one containing our offset
-    while(cluster_offset >= cluster_size){
-        current_file_cluster = get_next_cluster(img, b, current_file_cluster);
-        if(current_file_cluster >= 0x0FFFFFF8){
-            printf("Error: offset beyond file data\n");
-            free(entries);
-            return;
+    // Map the chain once per open; it gives the cluster count and tail
+    if (!f->extents_loaded) {
+        extent_build(img, b, f, file_cluster);
+        if (!f->extents_loaded) {
+            return -1;
         }
-        cluster_offset -= cluster_size;
     }
     
-    // read and print the data
-    int bytes_read = 0;
-    unsigned char* buffer = malloc(bytes_to_read + 1);
-    if(buffer == NULL){
-        printf("Error: memory allocation failed\n");
-        free(entries);
-        return;
-    }
+    // Calculate if we need to extend the file
+    off_t new_size = offset + len;
+    int need_extension = (new_size > filesize);
     
-    while(bytes_read < bytes_to_read && current_file_cluster < 0x0FFFFFF8){
-        // calc position in image file
-        unsigned int cluster_start = get_cluster_offset(b, current_file_cluster);
-        
-        // how many bytes to read from this cluster
-        unsigned int bytes_in_cluster = cluster_size - cluster_offset;
-        if(bytes_in_cluster > (unsigned int)(bytes_to_read - bytes_read)){
-            bytes_in_cluster = bytes_to_read - bytes_read;
-        }
-        
-        // seek to position and read
-        fseek(img, cluster_start + cluster_offset, SEEK_SET);
-        fread(buffer + bytes_read, 1, bytes_in_cluster, img);
+    // If we need more clusters, allocate them all in one go
+    if (need_extension) {
+        unsigned int current_clusters = f->nclusters;
+        unsigned int last_cluster = extent_tail(f);
         
-        bytes_read += bytes_in_cluster;
-        cluster_offset = 0;  // subsequent clusters start at offset 0
+        // Calculate how many clusters we need total
+        unsigned int clusters_needed = (new_size + cluster_size - 1) >> b->clus_shift;
         
-        // move to next cluster if needed
-        if(bytes_read < bytes_to_read){
-            current_file_cluster = get_next_cluster(img, b, current_file_cluster);
+        if (current_clusters < clusters_needed) {
+            // Reserve the whole run, placed right after the tail if possible
+            unsigned int first_new = fat_extend_chain(last_cluster, clusters_needed - current_clusters);
+            if (first_new == 0) {
+                printf("Error: no free clusters available\n");
+                f->offset = offset;     // the buffered bytes were not written
+                return -1;
+            }
+            
+            // Empty file: the new run becomes its first cluster
+            if (file_cluster == 0) {
+                file_cluster = first_new;
+                f->first_cluster = first_new;
+            }
+            if (f->extents_loaded) {
+                extent_append(img, b, f, first_new);
+            }
+            
+            // The new clusters start at or past the old end of the file,
+            // so the data covers them up to new_size. The buffer never
+            // crosses a cluster, so padding it with zeros to the end of
+            // its cluster clears the rest in the same write
+            unsigned int pad = (cluster_size - (new_size & (cluster_size - 1))) & (cluster_size - 1);
+            memset(f->wb_buf + len, 0, pad);
+            len += pad;
         }
     }
     
-    // null-terminate and print
-    buffer[bytes_read] = '\0';
-    printf("%s\n", buffer);
+    // Any read-ahead data for this handle is stale after the write
+    f->ra_count = 0;
     
-    // update the file offset
-    table[index].offset = offset + bytes_read;
+    // Split the write into one segment per contiguous run of clusters
+    if (!f->extents_loaded) {
+        extent_build(img, b, f, file_cluster);
+    }
+    blk_seg* segs = NULL;
+    int nsegs = file_segments(b, f, offset, f->wb_buf, len, &segs);
+    if (nsegs == 0) {
+        printf("Error: offset beyond file data\n");
+        return -1;
+    }
+    
+    // Write the data through the block cache
+    for (int i = 0; i < nsegs; i++) {
+        cache_write(img, segs[i].offset, segs[i].buf, segs[i].len);
+    }
     
-    free(buffer);
-    free(entries);
+    // Update file size and first cluster in the directory entry
+    // (located by open, so no directory search is needed)
+    if (new_size > filesize) {
+        f->filesize = new_size;
+        
+        dir_entry file_entry;
+        cache_read(img, f->entry_offset, &file_entry, sizeof(dir_entry));
+        file_entry.fstclushi = (file_cluster >> 16) & 0xFFFF;
+        file_entry.fstcluslo = file_cluster & 0xFFFF;
+        file_entry.filesize = new_size;
+        cache_write(img, f->entry_offset, &file_entry, sizeof(dir_entry));
+    }
+    return 0;
 }
 
-
-void write_file(char* filename, char* string, FILE* img, BPB* b, file_table* table, unsigned int current_cluster) {
+void write_file(char* filename, char* string, blkdev* img, BPB* b, file_table* table) {
     
     // Find file in table and check if opened for writing
     int index = -1;
@@ -711,616 +734,481 @@ void write_file(char* filename, char* string, FILE* img, BPB* b, file_table* tab
         return;
     }
     
-    // Get file info from table
-    int offset = table[index].offset;
-    int filesize = table[index].filesize;
+    file_table* f = &table[index];
+    off_t offset = f->offset;
     int string_len = strlen(string);
+    unsigned int cluster_size = b->cluster_size;
     
-    // Find the file's directory entry to get/update cluster info
-    int entry_count = 0;
-    dir_entry* entries = read_dir_chain(img, b, current_cluster, &entry_count);
-    if (entries == NULL) {
-        printf("Error: could not read directory\n");
+    // FAT32 sizes are 32-bit
+    if (offset + string_len > (off_t)UINT32_MAX) {
+        printf("Error: write would exceed the 4 GB file size limit\n");
         return;
     }
     
-    dir_entry* file_entry = NULL;
-    int entry_index = -1;
-    for (int i = 0; i < entry_count; i++) {
-        if (is_longname(&entries[i])) continue;
-        char* trimmed = trim_filename((char*)entries[i].name, 11);
-        if (strcmp(trimmed, filename) == 0) {
-            file_entry = &entries[i];
-            entry_index = i;
-            free(trimmed);
-            break;
-        }
-        free(trimmed);
-    }
-    
-    if (file_entry == NULL) {
-        printf("Error: file not found in directory\n");
-        free(entries);
-        return;
-    }
-    
-    // Check if it's a directory
-    if (is_directory(file_entry)) {
-        printf("Error: %s is a directory\n", filename);
-        free(entries);
-        return;
-    }
-    
-    // Get file's first cluster
-    unsigned int file_cluster = (file_entry->fstclushi << 16) | file_entry->fstcluslo;
-    unsigned int cluster_size = b->BytesPerSec * b->SecPerClus;
-    
-    // If file has no cluster allocated (empty file), allocate one
-    if (file_cluster == 0) {
-        // Find a free cluster
-        unsigned int data_sectors = b->TotSec32 - (b->RsvdSecCnt + b->NumFATs * b->FATSz32);
-        unsigned int total_clusters = data_sectors / b->SecPerClus;
-        
-        unsigned int new_cluster = 0;
-        for (unsigned int c = 2; c < total_clusters + 2; c++) {
-            unsigned int fat_offset = b->RsvdSecCnt * b->BytesPerSec + c * 4;
-            fseek(img, fat_offset, SEEK_SET);
-            unsigned int fat_entry;
-            fread(&fat_entry, sizeof(unsigned int), 1, img);
-            fat_entry &= 0x0FFFFFFF;
-            if (fat_entry == 0) {
-                new_cluster = c;
-                break;
-            }
-        }
-        
-        if (new_cluster == 0) {
-            printf("Error: no free clusters available\n");
-            free(entries);
+    if (f->wb_buf == NULL) {
+        f->wb_buf = malloc(cluster_size);
+        if (f->wb_buf == NULL) {
+            printf("Error: memory allocation failed\n");
             return;
         }
-        
-        // Mark cluster as end of chain
-        unsigned int fat_offset = b->RsvdSecCnt * b->BytesPerSec + new_cluster * 4;
-        unsigned int end_marker = 0x0FFFFFF8;
-        fseek(img, fat_offset, SEEK_SET);
-        fwrite(&end_marker, sizeof(unsigned int), 1, img);
-        fflush(img);
-        
-        // Update directory entry with new cluster
-        file_cluster = new_cluster;
-        file_entry->fstclushi = (new_cluster >> 16) & 0xFFFF;
-        file_entry->fstcluslo = new_cluster & 0xFFFF;
-        
-        // Clear the new cluster
-        unsigned char* clear_buf = calloc(1, cluster_size);
-        unsigned int cluster_offset_pos = get_cluster_offset(b, new_cluster);
-        fseek(img, cluster_offset_pos, SEEK_SET);
-        fwrite(clear_buf, 1, cluster_size, img);
-        fflush(img);
-        free(clear_buf);
-    }
-    
-    // Calculate if we need to extend the file
-    int new_size = offset + string_len;
-    int need_extension = (new_size > filesize);
-    
-    // If we need more clusters, allocate them
-    if (need_extension) {
-        // Find last cluster in chain
-        unsigned int last_cluster = file_cluster;
-        unsigned int next = get_next_cluster(img, b, last_cluster);
-        while (next != 0 && next < 0x0FFFFFF8) {
-            last_cluster = next;
-            next = get_next_cluster(img, b, last_cluster);
-        }
-        
-        // Calculate how many clusters we need total
-        int clusters_needed = (new_size + cluster_size - 1) / cluster_size;
-        
-        // Count current clusters
-        int current_clusters = 0;
-        unsigned int temp_cluster = file_cluster;
-        while (temp_cluster != 0 && temp_cluster < 0x0FFFFFF8) {
-            current_clusters++;
-            temp_cluster = get_next_cluster(img, b, temp_cluster);
-        }
-        
-        // Allocate additional clusters if needed
-        while (current_clusters < clusters_needed) {
-            // Find free cluster
-            unsigned int data_sectors = b->TotSec32 - (b->RsvdSecCnt + b->NumFATs * b->FATSz32);
-            unsigned int total_clusters = data_sectors / b->SecPerClus;
-            
-            unsigned int new_cluster = 0;
-            for (unsigned int c = 2; c < total_clusters + 2; c++) {
-                unsigned int fat_offset = b->RsvdSecCnt * b->BytesPerSec + c * 4;
-                fseek(img, fat_offset, SEEK_SET);
-                unsigned int fat_entry;
-                fread(&fat_entry, sizeof(unsigned int), 1, img);
-                fat_entry &= 0x0FFFFFFF;
-                if (fat_entry == 0) {
-                    new_cluster = c;
-                    break;
-                }
-            }
-            
-            if (new_cluster == 0) {
-                printf("Error: no free clusters available\n");
-                free(entries);
-                return;
-            }
-            
-            // Link last cluster to new cluster
-            unsigned int fat_offset = b->RsvdSecCnt * b->BytesPerSec + last_cluster * 4;
-            fseek(img, fat_offset, SEEK_SET);
-            fwrite(&new_cluster, sizeof(unsigned int), 1, img);
-            
-            // Mark new cluster as end of chain
-            fat_offset = b->RsvdSecCnt * b->BytesPerSec + new_cluster * 4;
-            unsigned int end_marker = 0x0FFFFFF8;
-            fseek(img, fat_offset, SEEK_SET);
-            fwrite(&end_marker, sizeof(unsigned int), 1, img);
-            fflush(img);
-            
-            // Clear new cluster
-            unsigned char* clear_buf = calloc(1, cluster_size);
-            unsigned int cluster_offset_pos = get_cluster_offset(b, new_cluster);
-            fseek(img, cluster_offset_pos, SEEK_SET);
-            fwrite(clear_buf, 1, cluster_size, img);
-            fflush(img);
-            free(clear_buf);
-            
-            last_cluster = new_cluster;
-            current_clusters++;
-        }
+        f->wb_len = 0;
     }
     
-    // Navigate to the cluster containing the offset
-    unsigned int cluster_offset = offset;
-    unsigned int current_file_cluster = file_cluster;
-    
-    while (cluster_offset >= cluster_size) {
-        current_file_cluster = get_next_cluster(img, b, current_file_cluster);
-        if (current_file_cluster >= 0x0FFFFFF8) {
-            printf("Error: offset beyond file data\n");
-            free(entries);
+    // The buffer holds one run of bytes inside one cluster: a write that
+    // does not continue it sends the old run out first
+    if (f->wb_len > 0 && offset != f->wb_offset + f->wb_len) {
+        if (write_flush(img, b, f) != 0) {
             return;
         }
-        cluster_offset -= cluster_size;
     }
     
-    // Write the data
-    int bytes_written = 0;
-    while (bytes_written < string_len && current_file_cluster < 0x0FFFFFF8) {
-        unsigned int cluster_start = get_cluster_offset(b, current_file_cluster);
-        
-        // How many bytes to write to this cluster
-        unsigned int bytes_in_cluster = cluster_size - cluster_offset;
-        if (bytes_in_cluster > (unsigned int)(string_len - bytes_written)) {
-            bytes_in_cluster = string_len - bytes_written;
+    // Collect the data, writing the buffer out each time it reaches the
+    // end of its cluster
+    int done = 0;
+    while (done < string_len) {
+        if (f->wb_len == 0) {
+            f->wb_offset = offset + done;
         }
-        
-        // Seek to position and write
-        fseek(img, cluster_start + cluster_offset, SEEK_SET);
-        fwrite(string + bytes_written, 1, bytes_in_cluster, img);
-        fflush(img);
-        
-        bytes_written += bytes_in_cluster;
-        cluster_offset = 0;
-        
-        if (bytes_written < string_len) {
-            current_file_cluster = get_next_cluster(img, b, current_file_cluster);
+        off_t end = f->wb_offset + f->wb_len;
+        unsigned int room = cluster_size - (end & (cluster_size - 1));
+        unsigned int chunk = string_len - done < (int)room ? (unsigned int)(string_len - done) : room;
+        memcpy(f->wb_buf + f->wb_len, string + done, chunk);
+        f->wb_len += chunk;
+        done += chunk;
+        if (chunk == room && write_flush(img, b, f) != 0) {
+            return;
         }
     }
     
-    // Update file size in directory entry if file grew
-    if (new_size > filesize) {
-        file_entry->filesize = new_size;
-        table[index].filesize = new_size;
-    }
-    
-    // Write updated directory entry back to disk
-    // Find the directory entry position and update it
-    unsigned int dir_cluster = current_cluster;
-    int entries_per_cluster = cluster_size / sizeof(dir_entry);
-    int entry_num = 0;
-    
-    // Skip to the correct cluster and entry
-    int target_entry = entry_index;
-    while (target_entry >= entries_per_cluster) {
-        dir_cluster = get_next_cluster(img, b, dir_cluster);
-        target_entry -= entries_per_cluster;
-    }
-    
-    unsigned int dir_offset = get_cluster_offset(b, dir_cluster) + (target_entry * sizeof(dir_entry));
-    fseek(img, dir_offset, SEEK_SET);
-    fwrite(file_entry, sizeof(dir_entry), 1, img);
-    fflush(img);
-    
     // Update offset in file table
-    table[index].offset = offset + string_len;
-    
-    free(entries);
+    f->offset = offset + string_len;
 }
 
 
-void mv(char* src, char* dest, FILE* img, BPB* b, unsigned int current_cluster, file_table* table) {
+void mv(char* src_path, char* dest_path, blkdev* img, BPB* b, unsigned int cwd, file_table* table) {
+    
+    // Find source entry (and where it is stored)
+    unsigned int current_cluster;
+    char src[PATH_NAME_MAX];
+    if (path_split(img, b, cwd, src_path, &current_cluster, src) != 0) {
+        return;
+    }
+    dir_entry src_entry;
+    off_t src_offset;
+    if (!find_entry_in_chain(img, b, current_cluster, src, &src_entry, &src_offset)) {
+        printf("Error: %s does not exist\n", src);
+        return;
+    }
     
     // Check if source file is open
     for (int i = 0; i < 10; i++) {
-        if (table[i].isopen == 1 && strcmp(table[i].filename, src) == 0) {
+        if (table[i].isopen == 1 && table[i].entry_offset == src_offset) {
             printf("Error: file is open, please close it first\n");
             return;
         }
     }
     
-    // Find source entry
-    int entry_count = 0;
-    dir_entry* entries = read_dir_chain(img, b, current_cluster, &entry_count);
-    if (entries == NULL) {
-        printf("Error: could not read directory\n");
+    // Check if destination exists
+    unsigned int dest_dir;
+    char dest[PATH_NAME_MAX];
+    if (path_split(img, b, cwd, dest_path, &dest_dir, dest) != 0) {
         return;
     }
+    dir_entry dest_entry;
+    off_t dest_offset;
+    int dest_exists = dest[0] == '\0' ||
+                      find_entry_in_chain(img, b, dest_dir, dest, &dest_entry, &dest_offset);
     
-    dir_entry* src_entry = NULL;
-    int src_index = -1;
-    for (int i = 0; i < entry_count; i++) {
-        if (is_longname(&entries[i])) continue;
-        char* trimmed = trim_filename((char*)entries[i].name, 11);
-        if (strcmp(trimmed, src) == 0) {
-            src_entry = &entries[i];
-            src_index = i;
-            free(trimmed);
-            break;
+    unsigned char old_name[11];
+    memcpy(old_name, src_entry.name, 11);
+    unsigned int src_cluster = (src_entry.fstclushi << 16) | src_entry.fstcluslo;
+    unsigned int dest_cluster = dest_dir;
+    if (dest_exists && dest[0] != '\0') {
+        // Destination exists - check if it's a directory
+        if (!is_directory(&dest_entry)) {
+            printf("Error: %s is a file, not a directory\n", dest);
+            return;
+        }
+        
+        // Move source into destination directory
+        dest_cluster = (dest_entry.fstclushi << 16) | dest_entry.fstcluslo;
+        if (dest_cluster == 0) {
+            dest_cluster = get_root_cluster(b);     // ".." of a top level directory
         }
-        free(trimmed);
+    } else if (!dest_exists) {
+        // Destination doesn't exist - source takes its name
+        format_name_83(dest, src_entry.name);
     }
     
-    if (src_entry == NULL) {
-        printf("Error: %s does not exist\n", src);
-        free(entries);
+    // a directory cannot go into itself or anywhere below it
+    if (is_directory(&src_entry) && dir_within(img, b, dest_cluster, src_cluster)) {
+        printf("Error: cannot move %s into itself\n", src);
         return;
     }
     
-    // Check if destination exists
-    dir_entry* dest_entry = NULL;
-    int dest_index = -1;
-    for (int i = 0; i < entry_count; i++) {
-        if (is_longname(&entries[i])) continue;
-        char* trimmed = trim_filename((char*)entries[i].name, 11);
-        if (strcmp(trimmed, dest) == 0) {
-            dest_entry = &entries[i];
-            dest_index = i;
-            free(trimmed);
-            break;
-        }
-        free(trimmed);
-    }
-    
-    unsigned int cluster_size = b->BytesPerSec * b->SecPerClus;
-    int entries_per_cluster = cluster_size / sizeof(dir_entry);
-    
-    if (dest_entry != NULL) {
-        // Destination exists - check if it's a directory
-        if (!is_directory(dest_entry)) {
-            printf("Error: %s is a file, not a directory\n", dest);
-            free(entries);
+    if (dest_cluster == current_cluster) {
+        // Rename in place (the name is already taken when moving a file
+        // "into" its own directory)
+        if (dest_exists) {
+            printf("Error: %s already exists in destination\n", src);
             return;
         }
+        dirindex_remove(current_cluster, old_name);
         
-        // Move source into destination directory
-        unsigned int dest_cluster = (dest_entry->fstclushi << 16) | dest_entry->fstcluslo;
-        
-        // Check if file already exists in destination
-        int dest_entry_count = 0;
-        dir_entry* dest_entries = read_dir_chain(img, b, dest_cluster, &dest_entry_count);
-        if (dest_entries != NULL) {
-            for (int i = 0; i < dest_entry_count; i++) {
-                if (is_longname(&dest_entries[i])) continue;
-                char* trimmed = trim_filename((char*)dest_entries[i].name, 11);
-                if (strcmp(trimmed, src) == 0) {
-                    printf("Error: %s already exists in destination\n", src);
-                    free(trimmed);
-                    free(dest_entries);
-                    free(entries);
-                    return;
-                }
-                free(trimmed);
-            }
-            free(dest_entries);
-        }
-        
-        // Find free entry in destination directory
-        unsigned int dest_dir_cluster = dest_cluster;
-        int found_slot = 0;
-        unsigned int slot_offset = 0;
-        
-        while (dest_dir_cluster != 0 && dest_dir_cluster < 0x0FFFFFF8 && !found_slot) {
-            unsigned int dir_offset = get_cluster_offset(b, dest_dir_cluster);
-            
-            for (int i = 0; i < entries_per_cluster; i++) {
-                fseek(img, dir_offset + (i * sizeof(dir_entry)), SEEK_SET);
-                unsigned char first_byte;
-                fread(&first_byte, 1, 1, img);
-                
-                if (first_byte == 0x00 || first_byte == 0xE5) {
-                    slot_offset = dir_offset + (i * sizeof(dir_entry));
-                    found_slot = 1;
-                    break;
-                }
-            }
-            
-            if (!found_slot) {
-                dest_dir_cluster = get_next_cluster(img, b, dest_dir_cluster);
-            }
+        // Write updated entry back to disk
+        cache_write(img, src_offset, &src_entry, sizeof(dir_entry));
+        dirindex_add(current_cluster, src_entry.name, src_offset);
+    } else {
+        // Write source entry to destination (fails if the name is taken
+        // there; a full destination directory is grown)
+        off_t slot_offset = dir_insert(img, b, dest_cluster, &src_entry);
+        if (slot_offset == 0) {
+            printf("Error: %s already exists in destination\n", src);
+            return;
         }
-        
-        if (!found_slot) {
+        if (slot_offset < 0) {
             printf("Error: destination directory is full\n");
-            free(entries);
             return;
         }
         
-        // Write source entry to destination
-        fseek(img, slot_offset, SEEK_SET);
-        fwrite(src_entry, sizeof(dir_entry), 1, img);
-        fflush(img);
-        
         // Mark source entry as deleted (0xE5)
-        unsigned int src_dir_cluster = current_cluster;
-        int src_target = src_index;
-        while (src_target >= entries_per_cluster) {
-            src_dir_cluster = get_next_cluster(img, b, src_dir_cluster);
-            src_target -= entries_per_cluster;
-        }
-        
-        unsigned int src_offset = get_cluster_offset(b, src_dir_cluster) + (src_target * sizeof(dir_entry));
         unsigned char deleted_marker = 0xE5;
-        fseek(img, src_offset, SEEK_SET);
-        fwrite(&deleted_marker, 1, 1, img);
-        fflush(img);
-        
-    } else {
-        // Destination doesn't exist - rename source to dest
-        // Format new name in 8.3 format
-        unsigned char new_name[11];
-        memset(new_name, ' ', 11);
-        int i = 0;
-        while (dest[i] && i < 11) {
-            new_name[i] = toupper((unsigned char)dest[i]);
-            i++;
-        }
-        
-        // Update name in source entry
-        memcpy(src_entry->name, new_name, 11);
+        cache_write(img, src_offset, &deleted_marker, 1);
+        dirindex_remove(current_cluster, old_name);
         
-        // Write updated entry back to disk
-        unsigned int src_dir_cluster = current_cluster;
-        int src_target = src_index;
-        while (src_target >= entries_per_cluster) {
-            src_dir_cluster = get_next_cluster(img, b, src_dir_cluster);
-            src_target -= entries_per_cluster;
+        // A moved directory gets its new parent in ".."
+        if (is_directory(&src_entry)) {
+            unsigned int parent = dest_cluster == get_root_cluster(b) ? 0 : dest_cluster;
+            dir_entry dotdot;
+            off_t dotdot_offset;
+            if (find_entry_in_chain(img, b, src_cluster, "..", &dotdot, &dotdot_offset)) {
+                dotdot.fstclushi = (parent >> 16) & 0xFFFF;
+                dotdot.fstcluslo = parent & 0xFFFF;
+                cache_write(img, dotdot_offset, &dotdot, sizeof(dir_entry));
+            }
         }
-        
-        unsigned int src_offset = get_cluster_offset(b, src_dir_cluster) + (src_target * sizeof(dir_entry));
-        fseek(img, src_offset, SEEK_SET);
-        fwrite(src_entry, sizeof(dir_entry), 1, img);
-        fflush(img);
     }
     
-    free(entries);
+    if (is_directory(&src_entry)) {
+        dcache_forget(src_cluster);
+    }
 }
 
-void rm(char* filename, FILE* img, BPB* b, unsigned int current_cluster, file_table* table) {
+void rm(char* path, blkdev* img, BPB* b, unsigned int cwd, file_table* table) {
     
-    // Check if file is open
-    for (int i = 0; i < 10; i++) {
-        if (table[i].isopen == 1 && strcmp(table[i].filename, filename) == 0) {
-            printf("Error: file is open, please close it first\n");
-            return;
-        }
+    // Find the directory holding the file, then the file entry
+    unsigned int current_cluster;
+    char filename[PATH_NAME_MAX];
+    if (path_split(img, b, cwd, path, &current_cluster, filename) != 0) {
+        return;
     }
-    
-    // Find the file entry
-    int entry_count = 0;
-    dir_entry* entries = read_dir_chain(img, b, current_cluster, &entry_count);
-    if (entries == NULL) {
-        printf("Error: could not read directory\n");
+    dir_entry file_entry;
+    off_t entry_offset;
+    if (!find_entry_in_chain(img, b, current_cluster, filename, &file_entry, &entry_offset)) {
+        printf("Error: %s does not exist\n", filename);
         return;
     }
     
-    dir_entry* file_entry = NULL;
-    int entry_index = -1;
-    for (int i = 0; i < entry_count; i++) {
-        if (is_longname(&entries[i])) continue;
-        char* trimmed = trim_filename((char*)entries[i].name, 11);
-        if (strcmp(trimmed, filename) == 0) {
-            file_entry = &entries[i];
-            entry_index = i;
-            free(trimmed);
-            break;
+    // Check if file is open
+    for (int i = 0; i < 10; i++) {
+        if (table[i].isopen == 1 && table[i].entry_offset == entry_offset) {
+            printf("Error: file is open, please close it first\n");
+            return;
         }
-        free(trimmed);
-    }
-    
-    if (file_entry == NULL) {
-        printf("Error: %s does not exist\n", filename);
-        free(entries);
-        return;
     }
     
     // Check if it's a directory
-    if (is_directory(file_entry)) {
+    if (is_directory(&file_entry)) {
         printf("Error: %s is a directory, use rmdir instead\n", filename);
-        free(entries);
         return;
     }
     
     // Get the file's first cluster
-    unsigned int file_cluster = (file_entry->fstclushi << 16) | file_entry->fstcluslo;
+    unsigned int file_cluster = (file_entry.fstclushi << 16) | file_entry.fstcluslo;
     
     // Free all clusters in the chain (if file has any clusters)
     if (file_cluster != 0 && file_cluster < 0x0FFFFFF8) {
-        unsigned int cluster = file_cluster;
-        while (cluster != 0 && cluster < 0x0FFFFFF8) {
-            // Get next cluster before freeing current one
-            unsigned int next_cluster = get_next_cluster(img, b, cluster);
-            
-            // Mark current cluster as free (write 0 to FAT entry)
-            unsigned int fat_offset = b->RsvdSecCnt * b->BytesPerSec + cluster * 4;
-            unsigned int free_marker = 0x00000000;
-            fseek(img, fat_offset, SEEK_SET);
-            fwrite(&free_marker, sizeof(unsigned int), 1, img);
-            fflush(img);
-            
-            cluster = next_cluster;
-        }
+        fat_free_chain(file_cluster);
     }
     
     // Mark directory entry as deleted (0xE5)
-    unsigned int cluster_size = b->BytesPerSec * b->SecPerClus;
-    int entries_per_cluster = cluster_size / sizeof(dir_entry);
-    
-    unsigned int dir_cluster = current_cluster;
-    int target_entry = entry_index;
-    while (target_entry >= entries_per_cluster) {
-        dir_cluster = get_next_cluster(img, b, dir_cluster);
-        target_entry -= entries_per_cluster;
-    }
-    
-    unsigned int entry_offset = get_cluster_offset(b, dir_cluster) + (target_entry * sizeof(dir_entry));
     unsigned char deleted_marker = 0xE5;
-    fseek(img, entry_offset, SEEK_SET);
-    fwrite(&deleted_marker, 1, 1, img);
-    fflush(img);
-    
-    free(entries);
+    cache_write(img, entry_offset, &deleted_marker, 1);
+    dirindex_remove(current_cluster, file_entry.name);
 }
 
-void rmdir_cmd(char* dirname, FILE* img, BPB* b, unsigned int current_cluster, file_table* table) {
+void rmdir_cmd(char* path, blkdev* img, BPB* b, unsigned int cwd, file_table* table) {
     
-    // Find the directory entry
-    int entry_count = 0;
-    dir_entry* entries = read_dir_chain(img, b, current_cluster, &entry_count);
-    if (entries == NULL) {
-        printf("Error: could not read directory\n");
+    // Find the directory holding it, then the directory entry
+    unsigned int current_cluster;
+    char dirname[PATH_NAME_MAX];
+    if (path_split(img, b, cwd, path, &current_cluster, dirname) != 0) {
         return;
     }
-    
-    dir_entry* dir_entry_ptr = NULL;
-    int entry_index = -1;
-    for (int i = 0; i < entry_count; i++) {
-        if (is_longname(&entries[i])) continue;
-        char* trimmed = trim_filename((char*)entries[i].name, 11);
-        if (strcmp(trimmed, dirname) == 0) {
-            dir_entry_ptr = &entries[i];
-            entry_index = i;
-            free(trimmed);
-            break;
-        }
-        free(trimmed);
-    }
-    
-    if (dir_entry_ptr == NULL) {
+    dir_entry dir_entry_found;
+    off_t entry_offset;
+    if (!find_entry_in_chain(img, b, current_cluster, dirname, &dir_entry_found, &entry_offset)) {
         printf("Error: %s does not exist\n", dirname);
-        free(entries);
         return;
     }
     
     // Check if it's a directory
-    if (!is_directory(dir_entry_ptr)) {
+    if (!is_directory(&dir_entry_found)) {
         printf("Error: %s is not a directory\n", dirname);
-        free(entries);
         return;
     }
     
     // Get the directory's first cluster
-    unsigned int dir_cluster = (dir_entry_ptr->fstclushi << 16) | dir_entry_ptr->fstcluslo;
+    unsigned int dir_cluster = (dir_entry_found.fstclushi << 16) | dir_entry_found.fstcluslo;
+    
+    // Check that no open file lives in it
+    for (int i = 0; i < 10; i++) {
+        if (table[i].isopen == 1 && table[i].dir_cluster == dir_cluster) {
+            printf("Error: a file is open in directory %s\n", dirname);
+            return;
+        }
+    }
     
     // Check if directory is empty (only "." and ".." allowed)
-    int dir_entry_count = 0;
-    dir_entry* dir_entries = read_dir_chain(img, b, dir_cluster, &dir_entry_count);
-    if (dir_entries == NULL) {
+    dir_iter it;
+    if (dir_iter_open(&it, img, b, dir_cluster) != 0) {
         printf("Error: could not read directory contents\n");
-        free(entries);
         return;
     }
     
-    // Check for any files open in the directory
-    for (int i = 0; i < 10; i++) {
-        if (table[i].isopen == 1) {
-            // Check if path contains this directory
-            // This is a simple check - you might need more sophisticated path matching
-            for (int j = 0; j < dir_entry_count; j++) {
-                if (is_longname(&dir_entries[j])) continue;
-                char* trimmed = trim_filename((char*)dir_entries[j].name, 11);
-                if (strcmp(table[i].filename, trimmed) == 0) {
-                    printf("Error: a file is open in directory %s\n", dirname);
-                    free(trimmed);
-                    free(dir_entries);
-                    free(entries);
-                    return;
-                }
-                free(trimmed);
-            }
-        }
-    }
-    
-    // Count non-. and non-.. entries
+    unsigned char dot[11], dotdot[11];
+    name_encode(".", dot);
+    name_encode("..", dotdot);
     int real_entries = 0;
-    for (int i = 0; i < dir_entry_count; i++) {
-        if (is_longname(&dir_entries[i])) continue;
-        
-        char* trimmed = trim_filename((char*)dir_entries[i].name, 11);
-        
+    dir_entry* entry;
+    while ((entry = dir_iter_next(&it, NULL)) != NULL) {
         // Skip "." and ".."
-        if (strcmp(trimmed, ".") != 0 && strcmp(trimmed, "..") != 0) {
+        if (!name_matches(entry, dot) && !name_matches(entry, dotdot)) {
             real_entries++;
+            break;  // one is enough
         }
-        free(trimmed);
     }
-    
-    free(dir_entries);
+    dir_iter_close(&it);
     
     if (real_entries > 0) {
         printf("Error: directory %s is not empty\n", dirname);
-        free(entries);
         return;
     }
     
-    // Free all clusters used by the directory
-    unsigned int cluster = dir_cluster;
-    while (cluster != 0 && cluster < 0x0FFFFFF8) {
-        // Get next cluster before freeing current one
-        unsigned int next_cluster = get_next_cluster(img, b, cluster);
-        
-        // Mark current cluster as free (write 0 to FAT entry)
-        unsigned int fat_offset = b->RsvdSecCnt * b->BytesPerSec + cluster * 4;
-        unsigned int free_marker = 0x00000000;
-        fseek(img, fat_offset, SEEK_SET);
-        fwrite(&free_marker, sizeof(unsigned int), 1, img);
-        fflush(img);
-        
-        cluster = next_cluster;
-    }
+    // Free all clusters used by the directory; its index and cached
+    // dentries go with them
+    fat_free_chain(dir_cluster);
+    dirindex_drop(dir_cluster);
+    dcache_forget(dir_cluster);
     
     // Mark directory entry as deleted (0xE5)
-    unsigned int cluster_size = b->BytesPerSec * b->SecPerClus;
-    int entries_per_cluster = cluster_size / sizeof(dir_entry);
-    
-    unsigned int parent_cluster = current_cluster;
-    int target_entry = entry_index;
-    while (target_entry >= entries_per_cluster) {
-        parent_cluster = get_next_cluster(img, b, parent_cluster);
-        target_entry -= entries_per_cluster;
-    }
-    
-    unsigned int entry_offset = get_cluster_offset(b, parent_cluster) + (target_entry * sizeof(dir_entry));
     unsigned char deleted_marker = 0xE5;
-    fseek(img, entry_offset, SEEK_SET);
-    fwrite(&deleted_marker, 1, 1, img);
-    fflush(img);
-    
-    free(entries);
+    cache_write(img, entry_offset, &deleted_marker, 1);
+    dirindex_remove(current_cluster, dir_entry_found.name);
+}
+
+// copy a host file into a new file in the image. the clusters for the
+// whole file are reserved in one go (one contiguous run when the volume
+// has one), then the host file is streamed through a large aligned buffer
+// and written as whole clusters that bypass the block cache; the tail of
+// the last cluster is padded with zeros, so nothing is cleared first
+void import_file(char* host_path, char* path, blkdev* img, BPB* b, unsigned int cwd) {
+    unsigned int current_cluster;
+    char filename[PATH_NAME_MAX];
+    if (path_split(img, b, cwd, path, &current_cluster, filename) != 0) {
+        return;
+    }
+    if (strlen(filename) == 0) {
+        printf("Error: Filename required\n");
+        return;
+    }
+    if (strlen(filename) > 11) {
+        printf("Error: Filename too long (max 11 characters)\n");
+        return;
+    }
+
+    FILE *host = fopen(host_path, "rb");
+    if (host == NULL) {
+        printf("Error: cannot open %s\n", host_path);
+        return;
+    }
+    off_t size = -1;
+    if (fseeko(host, 0, SEEK_END) == 0) {
+        size = ftello(host);
+        fseeko(host, 0, SEEK_SET);
+    }
+    if (size < 0) {
+        printf("Error: cannot get the size of %s\n", host_path);
+        fclose(host);
+        return;
+    }
+    if (size > (off_t)UINT32_MAX) {
+        printf("Error: %s is larger than the 4 GB file size limit\n", host_path);
+        fclose(host);
+        return;
+    }
+
+    // whole clusters per buffer, so every write starts on a cluster
+    unsigned int cluster_size = b->cluster_size;
+    size_t buf_size = IO_BUF_BYTES < cluster_size ? cluster_size : IO_BUF_BYTES & ~(size_t)(cluster_size - 1);
+    unsigned char *buf = NULL;
+    if (posix_memalign((void **)&buf, 4096, buf_size) != 0) {
+        printf("Error: memory allocation failed\n");
+        fclose(host);
+        return;
+    }
+
+    // reserve every cluster of the file up front
+    unsigned int nclusters = (size + cluster_size - 1) >> b->clus_shift;
+    unsigned int first_cluster = 0;
+    if (nclusters > 0) {
+        first_cluster = fat_extend_chain(0, nclusters);
+        if (first_cluster == 0) {
+            printf("Error: no free clusters available\n");
+            free(buf);
+            fclose(host);
+            return;
+        }
+    }
+
+    dir_entry new_entry;
+    memset(&new_entry, 0, sizeof(dir_entry));
+    format_name_83(filename, new_entry.name);
+    new_entry.attr = ATTR_ARCHIVE;
+    new_entry.fstclushi = (first_cluster >> 16) & 0xFFFF;
+    new_entry.fstcluslo = first_cluster & 0xFFFF;
+    new_entry.filesize = 0;     // set once the data is in
+
+    off_t entry_offset = dir_insert(img, b, current_cluster, &new_entry);
+    if (entry_offset <= 0) {
+        if (entry_offset == 0) {
+            printf("Error: '%s' already exists\n", filename);
+        } else {
+            printf("Error: No free clusters to extend directory\n");
+        }
+        fat_free_chain(first_cluster);
+        free(buf);
+        fclose(host);
+        return;
+    }
+
+    file_table f;
+    memset(&f, 0, sizeof(file_table));
+    extent_build(img, b, &f, first_cluster);
+
+    off_t done = 0;
+    while (done < size) {
+        size_t want = size - done < (off_t)buf_size ? (size_t)(size - done) : buf_size;
+        size_t got = fread(buf, 1, want, host);
+        if (got == 0) {
+            break;  // the host file got shorter
+        }
+
+        size_t padded = (got + cluster_size - 1) & ~(size_t)(cluster_size - 1);
+        memset(buf + got, 0, padded - got);
+
+        blk_seg *segs;
+        int n = file_segments(b, &f, done, buf, padded, &segs);
+        cache_write_segs(img, segs, n);
+        done += got;
+    }
+
+    // the host file got shorter while it was read: give back the rest
+    unsigned int used = (done + cluster_size - 1) >> b->clus_shift;
+    if (used < nclusters) {
+        if (used == 0) {
+            fat_free_chain(first_cluster);
+            first_cluster = 0;
+            new_entry.fstclushi = 0;
+            new_entry.fstcluslo = 0;
+        } else {
+            unsigned int last = extent_lookup(&f, used - 1);
+            fat_free_chain(get_next_cluster(img, b, last));
+            fat_set(last, FAT_EOC);
+        }
+    }
+    extent_clear(&f);
+    free(buf);
+    fclose(host);
+
+    new_entry.filesize = done;
+    cache_write(img, entry_offset, &new_entry, sizeof(dir_entry));
+    printf("Imported %lld bytes\n", (long long)done);
+}
+
+void export_file(char* path, char* host_path, blkdev* img, BPB* b, unsigned int cwd, file_table* table) {
+    unsigned int current_cluster;
+    char filename[PATH_NAME_MAX];
+    if (path_split(img, b, cwd, path, &current_cluster, filename) != 0) {
+        return;
+    }
+    dir_entry file_entry;
+    off_t entry_offset;
+    if (!find_entry_in_chain(img, b, current_cluster, filename, &file_entry, &entry_offset)) {
+        printf("Error: %s does not exist\n", filename);
+        return;
+    }
+    if (is_directory(&file_entry)) {
+        printf("Error: %s is a directory\n", filename);
+        return;
+    }
+
+    // take in what an open handle still buffers for the file
+    for (int i = 0; i < 10; i++) {
+        if (table[i].isopen == 1 && table[i].entry_offset == entry_offset) {
+            write_flush(img, b, &table[i]);
+            cache_read(img, entry_offset, &file_entry, sizeof(dir_entry));
+        }
+    }
+
+    FILE *host = fopen(host_path, "wb");
+    if (host == NULL) {
+        printf("Error: cannot create %s\n", host_path);
+        return;
+    }
+
+    // the kernel copies from the image file, so it must see every block
+    cache_sync(img);
+
+    file_table f;
+    memset(&f, 0, sizeof(file_table));
+    extent_build(img, b, &f, (file_entry.fstclushi << 16) | file_entry.fstcluslo);
+
+    // one copy per run of adjacent clusters
+    off_t size = file_entry.filesize;
+    off_t done = 0;
+    for (int i = 0; i < f.extent_count && done < size; i++) {
+        extent *run = &f.extents[i];
+        off_t start = (off_t)run->logical << b->clus_shift;
+        off_t len = (off_t)run->count << b->clus_shift;
+        if (len > size - start) {
+            len = size - start;
+        }
+        long n = blk_copy_out(img, get_cluster_offset(b, run->physical), len, fileno(host), start);
+        done = start + n;
+        if (n != len) {
+            break;
+        }
+    }
+    extent_clear(&f);
+    fclose(host);
+
+    if (done < size) {
+        printf("Error: only %lld of %lld bytes were copied to %s\n",
+               (long long)done, (long long)size, host_path);
+        return;
+    }
+    printf("Exported %lld bytes\n", (long long)done);
+}
+
+void sync_image(blkdev* img, BPB* b, file_table* table) {
+    // buffered writes of open files first
+    for (int i = 0; i < 10; i++) {
+        if (table[i].isopen == 1) {
+            write_flush(img, b, &table[i]);
+        }
+    }
+    // FAT sectors go into the cache first so they are written in the same pass
+    fat_flush(img, b);
+    cache_sync(img);
 }
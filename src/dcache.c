@@ -0,0 +1,269 @@
+#include "common.h"
+
+typedef struct {
+    unsigned int parent;            // directory holding the entry, 0 = unused
+    unsigned int cluster;           // first cluster of the directory it names
+    unsigned char name[11];         // raw name; all zero for a bare parent link
+    int next_name;                  // chain in by_name (free list when unused)
+    int next_cluster;               // chain in by_cluster
+} dentry;
+
+static dentry dents[DCACHE_ENTRIES];
+static int by_name[DCACHE_BUCKETS];
+static int by_cluster[DCACHE_BUCKETS];
+static int free_head = -1;
+static int ready = 0;
+
+static unsigned int hash_key(unsigned int parent, const unsigned char *name) {
+    unsigned int h = 2166136261u ^ parent;
+    for (int i = 0; i < 11; i++) {
+        h = (h ^ name[i]) * 16777619u;
+    }
+    return h & (DCACHE_BUCKETS - 1);
+}
+
+static unsigned int hash_cluster(unsigned int cluster) {
+    return (cluster * 2654435761u) >> 24 & (DCACHE_BUCKETS - 1);
+}
+
+void dcache_clear(void) {
+    for (int i = 0; i < DCACHE_BUCKETS; i++) {
+        by_name[i] = -1;
+        by_cluster[i] = -1;
+    }
+    for (int i = 0; i < DCACHE_ENTRIES; i++) {
+        dents[i].parent = 0;
+        dents[i].next_name = i + 1 < DCACHE_ENTRIES ? i + 1 : -1;
+    }
+    free_head = 0;
+    ready = 1;
+}
+
+// index of the dentry naming cluster, or -1
+static int find_cluster(unsigned int cluster) {
+    for (int i = by_cluster[hash_cluster(cluster)]; i >= 0; i = dents[i].next_cluster) {
+        if (dents[i].cluster == cluster) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void unlink_chain(int *head, int i, int name_chain) {
+    while (*head != i) {
+        head = name_chain ? &dents[*head].next_name : &dents[*head].next_cluster;
+    }
+    *head = name_chain ? dents[i].next_name : dents[i].next_cluster;
+}
+
+static void remove_dentry(int i) {
+    dentry *d = &dents[i];
+    unlink_chain(&by_name[hash_key(d->parent, d->name)], i, 1);
+    unlink_chain(&by_cluster[hash_cluster(d->cluster)], i, 0);
+    d->parent = 0;
+    d->next_name = free_head;
+    free_head = i;
+}
+
+// first cluster of the subdirectory called name (raw) in parent, or 0
+unsigned int dcache_lookup(unsigned int parent, const unsigned char *name) {
+    if (!ready) {
+        return 0;
+    }
+    for (int i = by_name[hash_key(parent, name)]; i >= 0; i = dents[i].next_name) {
+        if (dents[i].parent == parent && memcmp(dents[i].name, name, 11) == 0) {
+            return dents[i].cluster;
+        }
+    }
+    return 0;
+}
+
+// parent directory of the directory starting at cluster, or 0 if unknown
+unsigned int dcache_parent(unsigned int cluster) {
+    if (!ready) {
+        return 0;
+    }
+    int i = find_cluster(cluster);
+    return i >= 0 ? dents[i].parent : 0;
+}
+
+// the directory starting at cluster is called name (raw) in parent. name
+// may be NULL when only the parent is known (learned from "..")
+void dcache_add(unsigned int parent, const unsigned char *name, unsigned int cluster) {
+    if (!ready) {
+        dcache_clear();
+    }
+
+    // a directory has one parent: replace what is known about it
+    int old = find_cluster(cluster);
+    if (old >= 0) {
+        remove_dentry(old);
+    }
+    if (free_head < 0) {
+        dcache_clear();
+    }
+
+    int i = free_head;
+    dentry *d = &dents[i];
+    free_head = d->next_name;
+    d->parent = parent;
+    d->cluster = cluster;
+    if (name != NULL) {
+        memcpy(d->name, name, 11);
+    } else {
+        memset(d->name, 0, 11);
+    }
+
+    unsigned int h = hash_key(parent, d->name);
+    d->next_name = by_name[h];
+    by_name[h] = i;
+    h = hash_cluster(cluster);
+    d->next_cluster = by_cluster[h];
+    by_cluster[h] = i;
+}
+
+// the directory starting at cluster was renamed, moved or removed. its
+// subdirectories are dropped too, so a reused cluster starts clean
+void dcache_forget(unsigned int cluster) {
+    if (!ready) {
+        return;
+    }
+    for (int i = 0; i < DCACHE_ENTRIES; i++) {
+        if (dents[i].parent != 0 && (dents[i].cluster == cluster || dents[i].parent == cluster)) {
+            remove_dentry(i);
+        }
+    }
+}
+
+// the directory called name inside dir, or 0 (with a message) if there is none
+static unsigned int walk_step(blkdev *img, BPB *b, unsigned int dir, const char *name) {
+    dir_entry entry;
+    off_t entry_offset;
+
+    if (name[0] == '\0' || strcmp(name, ".") == 0) {
+        return dir;
+    }
+
+    if (strcmp(name, "..") == 0) {
+        unsigned int parent = dcache_parent(dir);
+        if (parent != 0) {
+            return parent;
+        }
+        // not cached: ask the ".." entry (the root has none)
+        if (dir == get_root_cluster(b) ||
+            !find_entry_in_chain(img, b, dir, "..", &entry, &entry_offset)) {
+            printf("ERROR: Cannot go to parent directory.\n");
+            return 0;
+        }
+        parent = (entry.fstclushi << 16) | entry.fstcluslo;
+        if (parent == 0) {
+            parent = get_root_cluster(b);
+        }
+        dcache_add(parent, NULL, dir);
+        return parent;
+    }
+
+    unsigned char key[11];
+    if (name_encode(name, key)) {
+        unsigned int cluster = dcache_lookup(dir, key);
+        if (cluster != 0) {
+            return cluster;
+        }
+    }
+
+    if (!find_entry_in_chain(img, b, dir, name, &entry, &entry_offset)) {
+        printf("ERROR: %s does not exist.\n", name);
+        return 0;
+    }
+    if (!is_directory(&entry)) {
+        printf("ERROR: %s is not a directory.\n", name);
+        return 0;
+    }
+
+    unsigned int cluster = (entry.fstclushi << 16) | entry.fstcluslo;
+    dcache_add(dir, entry.name, cluster);
+    return cluster;
+}
+
+// walk the components of path from *dir. with keep_last the final
+// component is not walked but copied to last. returns -1 on failure
+static int walk(blkdev *img, BPB *b, unsigned int *dir, const char *path, int keep_last, char *last) {
+    if (path[0] == '/') {
+        *dir = get_root_cluster(b);
+    }
+
+    const char *p = path;
+    while (*p != '\0') {
+        while (*p == '/') {
+            p++;
+        }
+        const char *end = p;
+        while (*end != '\0' && *end != '/') {
+            end++;
+        }
+
+        char name[PATH_NAME_MAX];
+        size_t len = end - p;
+        if (len >= sizeof(name)) {
+            len = sizeof(name) - 1;
+        }
+        memcpy(name, p, len);
+        name[len] = '\0';
+
+        // the final component (trailing slashes do not count)
+        const char *rest = end;
+        while (*rest == '/') {
+            rest++;
+        }
+        if (keep_last && *rest == '\0') {
+            strcpy(last, name);
+            return 0;
+        }
+
+        if (len > 0) {
+            *dir = walk_step(img, b, *dir, name);
+            if (*dir == 0) {
+                return -1;
+            }
+        }
+        p = end;
+    }
+
+    if (keep_last) {
+        last[0] = '\0';
+    }
+    return 0;
+}
+
+// 1 if dir is ancestor itself or lies somewhere below it, found by
+// following ".." links up to the root
+int dir_within(blkdev *img, BPB *b, unsigned int dir, unsigned int ancestor) {
+    unsigned int root = get_root_cluster(b);
+    // a damaged image could link directories in a loop
+    for (unsigned int depth = 0; dir != 0 && depth <= b->cluster_count; depth++) {
+        if (dir == ancestor) {
+            return 1;
+        }
+        if (dir == root) {
+            return 0;
+        }
+        dir = walk_step(img, b, dir, "..");
+    }
+    return 0;
+}
+
+// cluster of the directory at path (absolute or relative to cwd), or 0
+// (with a message) if it cannot be reached
+unsigned int path_walk(blkdev *img, BPB *b, unsigned int cwd, const char *path) {
+    unsigned int dir = cwd;
+    return walk(img, b, &dir, path, 0, NULL) == 0 ? dir : 0;
+}
+
+// split path into the directory that holds its final component and that
+// component (last holds PATH_NAME_MAX bytes; empty if path ends in '/').
+// returns -1 (with a message) if a directory on the way cannot be reached
+int path_split(blkdev *img, BPB *b, unsigned int cwd, const char *path,
+               unsigned int *dir, char *last) {
+    *dir = cwd;
+    return walk(img, b, dir, path, 1, last);
+}
@@ -0,0 +1,416 @@
+#include "common.h"
+
+#define SLOT_EMPTY      -1L
+#define SLOT_DELETED    -2L
+
+typedef struct {
+    unsigned char name[11];         // raw name as stored in the dir entry
+    off_t offset;                   // entry offset, or SLOT_EMPTY/SLOT_DELETED
+} index_slot;
+
+typedef struct {
+    unsigned int cluster;           // first cluster of the directory, 0 = unused
+    index_slot *slots;
+    unsigned int cap;               // power of two
+    unsigned int count;             // live names
+    unsigned int used;              // live names + deleted slots
+    unsigned long last_use;
+
+    // slot hints. a position counts entries from the start of the chain
+    off_t *starts;                  // byte offset of each cluster of the chain
+    unsigned int chain_len, chain_cap;
+    unsigned int tail;              // last cluster of the chain
+    unsigned int per_cluster;       // entries per cluster
+    unsigned int free_pos;          // no free slot before this position
+    unsigned int end_pos;           // end marker (chain_len * per_cluster when full)
+    unsigned int holes;             // deleted slots before end_pos
+} dir_index;
+
+static dir_index dirs[DIRINDEX_DIRS];
+static unsigned long use_clock = 0;
+
+// FNV-1a over the 11 name bytes
+static unsigned int hash_name(const unsigned char *name) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < 11; i++) {
+        h = (h ^ name[i]) * 16777619u;
+    }
+    return h;
+}
+
+static int alloc_slots(dir_index *d, unsigned int cap) {
+    d->slots = (index_slot *)malloc(cap * sizeof(index_slot));
+    if (d->slots == NULL) {
+        return -1;
+    }
+    for (unsigned int i = 0; i < cap; i++) {
+        d->slots[i].offset = SLOT_EMPTY;
+    }
+    d->cap = cap;
+    d->count = 0;
+    d->used = 0;
+    return 0;
+}
+
+// slot holding name, or -1
+static int find_slot(dir_index *d, const unsigned char *name) {
+    unsigned int mask = d->cap - 1;
+    for (unsigned int i = hash_name(name) & mask; ; i = (i + 1) & mask) {
+        if (d->slots[i].offset == SLOT_EMPTY) {
+            return -1;
+        }
+        if (d->slots[i].offset >= 0 && memcmp(d->slots[i].name, name, 11) == 0) {
+            return i;
+        }
+    }
+}
+
+static void insert_slot(dir_index *d, const unsigned char *name, off_t offset) {
+    unsigned int mask = d->cap - 1;
+    unsigned int i = hash_name(name) & mask;
+    while (d->slots[i].offset >= 0) {
+        i = (i + 1) & mask;
+    }
+    if (d->slots[i].offset == SLOT_EMPTY) {
+        d->used++;
+    }
+    memcpy(d->slots[i].name, name, 11);
+    d->slots[i].offset = offset;
+    d->count++;
+}
+
+// keep the table at most 3/4 full (deleted slots included)
+static int make_room(dir_index *d) {
+    if ((d->used + 1) * 4 <= d->cap * 3) {
+        return 0;
+    }
+
+    index_slot *old = d->slots;
+    unsigned int old_cap = d->cap;
+    unsigned int cap = d->cap;
+    if ((d->count + 1) * 2 > cap) {
+        cap *= 2;   // mostly live names: grow; otherwise just drop the deleted slots
+    }
+    if (alloc_slots(d, cap) != 0) {
+        d->slots = old;
+        d->cap = old_cap;
+        return -1;
+    }
+    for (unsigned int i = 0; i < old_cap; i++) {
+        if (old[i].offset >= 0) {
+            insert_slot(d, old[i].name, old[i].offset);
+        }
+    }
+    free(old);
+    return 0;
+}
+
+static void forget(dir_index *d) {
+    free(d->slots);
+    free(d->starts);
+    d->slots = NULL;
+    d->starts = NULL;
+    d->cluster = 0;
+    d->cap = d->count = d->used = 0;
+    d->chain_len = d->chain_cap = 0;
+}
+
+static int append_cluster(dir_index *d, BPB *b, unsigned int cluster) {
+    if (d->chain_len == d->chain_cap) {
+        unsigned int cap = d->chain_cap ? d->chain_cap * 2 : 8;
+        off_t *starts = (off_t *)realloc(d->starts, cap * sizeof(off_t));
+        if (starts == NULL) {
+            return -1;
+        }
+        d->starts = starts;
+        d->chain_cap = cap;
+    }
+    d->starts[d->chain_len++] = get_cluster_offset(b, cluster);
+    d->tail = cluster;
+    return 0;
+}
+
+// position of the entry at offset, or -1 if it is not in the chain.
+// searched from the tail, where new entries go
+static long offset_pos(dir_index *d, off_t offset) {
+    long cluster_size = d->per_cluster * sizeof(dir_entry);
+    for (unsigned int i = d->chain_len; i-- > 0; ) {
+        if (offset >= d->starts[i] && offset < d->starts[i] + cluster_size) {
+            return (long)i * d->per_cluster + (offset - d->starts[i]) / sizeof(dir_entry);
+        }
+    }
+    return -1;
+}
+
+static off_t pos_offset(dir_index *d, unsigned int pos) {
+    return d->starts[pos / d->per_cluster] + (pos % d->per_cluster) * sizeof(dir_entry);
+}
+
+// an entry was written at offset
+static void slot_used(dir_index *d, off_t offset) {
+    long pos = offset_pos(d, offset);
+    if (pos < 0) {
+        return;
+    }
+    if (pos < d->end_pos) {
+        if (d->holes > 0) {
+            d->holes--;
+        }
+    } else {
+        d->end_pos = pos + 1;   // the end marker moves up one slot
+    }
+    if (pos == d->free_pos) {
+        d->free_pos = pos + 1;
+    }
+}
+
+// the entry at offset was deleted
+static void slot_freed(dir_index *d, off_t offset) {
+    long pos = offset_pos(d, offset);
+    if (pos < 0 || pos >= d->end_pos) {
+        return;
+    }
+    d->holes++;
+    if (pos < d->free_pos) {
+        d->free_pos = pos;
+    }
+}
+
+static dir_index *find_dir(unsigned int dir_cluster) {
+    for (int i = 0; i < DIRINDEX_DIRS; i++) {
+        if (dirs[i].cluster == dir_cluster && dirs[i].slots != NULL) {
+            return &dirs[i];
+        }
+    }
+    return NULL;
+}
+
+// scan the directory chain once: index every live entry and note the
+// clusters, the end marker and the deleted slots before it
+static dir_index *build(blkdev *img, BPB *b, unsigned int dir_cluster) {
+    // reuse an unused index, else the least recently used one
+    dir_index *d = &dirs[0];
+    for (int i = 0; i < DIRINDEX_DIRS; i++) {
+        if (dirs[i].slots == NULL) {
+            d = &dirs[i];
+            break;
+        }
+        if (dirs[i].last_use < d->last_use) {
+            d = &dirs[i];
+        }
+    }
+    forget(d);
+
+    unsigned int cluster_size = b->cluster_size;
+    int per = cluster_size / sizeof(dir_entry);
+    uint64_t live[DIRSCAN_WORDS(per)];
+    uint64_t spare[DIRSCAN_WORDS(per)];
+
+    dir_entry *buf = (dir_entry *)malloc(cluster_size);
+    if (buf == NULL || alloc_slots(d, 64) != 0) {
+        free(buf);
+        forget(d);
+        return NULL;
+    }
+    d->cluster = dir_cluster;
+    d->per_cluster = per;
+    d->holes = 0;
+
+    long first_free = -1;
+    int at_end = 0;
+    for (unsigned int c = dir_cluster; c != 0 && c < FAT_EOC; c = get_next_cluster(img, b, c)) {
+        unsigned int base = d->chain_len * per;
+        if (append_cluster(d, b, c) != 0) {
+            goto fail;
+        }
+        if (at_end) {
+            continue;   // past the end marker every slot is free
+        }
+
+        off_t start = d->starts[d->chain_len - 1];
+        dir_entry *entries = cluster_entries(img, b, start, buf);
+        int end = dirscan_classify(entries, per, live, spare);
+
+        for (int w = 0; w < DIRSCAN_WORDS(per); w++) {
+            for (uint64_t bits = live[w]; bits != 0; bits &= bits - 1) {
+                int i = w * 64 + __builtin_ctzll(bits);
+                // the first entry with a name wins, as with a linear search
+                if (find_slot(d, entries[i].name) >= 0) {
+                    continue;
+                }
+                if (make_room(d) != 0) {
+                    goto fail;
+                }
+                insert_slot(d, entries[i].name, start + i * sizeof(dir_entry));
+            }
+
+            // deleted slots are the spare ones before the end marker
+            uint64_t holes = spare[w];
+            int lo = w * 64;
+            if (end <= lo) {
+                holes = 0;
+            } else if (end - lo < 64) {
+                holes &= ((uint64_t)1 << (end - lo)) - 1;
+            }
+            if (holes != 0 && first_free < 0) {
+                first_free = base + lo + __builtin_ctzll(holes);
+            }
+            d->holes += __builtin_popcountll(holes);
+        }
+
+        if (end < per) {
+            at_end = 1;
+            d->end_pos = base + end;
+        }
+    }
+    if (!at_end) {
+        d->end_pos = d->chain_len * per;
+    }
+    d->free_pos = first_free >= 0 ? (unsigned int)first_free : d->end_pos;
+
+    free(buf);
+    return d;
+
+fail:
+    free(buf);
+    forget(d);
+    return NULL;
+}
+
+// lowest deleted slot at or after free_pos, or 0 if there is none before
+// the end marker
+static off_t find_hole(blkdev *img, BPB *b, dir_index *d) {
+    unsigned int cluster_size = d->per_cluster * sizeof(dir_entry);
+    int per = d->per_cluster;
+    uint64_t live[DIRSCAN_WORDS(per)];
+    uint64_t spare[DIRSCAN_WORDS(per)];
+
+    dir_entry *buf = (dir_entry *)malloc(cluster_size);
+    if (buf == NULL) {
+        return 0;
+    }
+
+    off_t slot = 0;
+    int done = 0;
+    for (unsigned int c = d->free_pos / per; !done && c < d->chain_len && c * per < d->end_pos; c++) {
+        dir_entry *entries = cluster_entries(img, b, d->starts[c], buf);
+        dirscan_classify(entries, per, live, spare);
+
+        // first spare slot of the cluster at or after free_pos
+        unsigned int from = c * per < d->free_pos ? d->free_pos - c * per : 0;
+        for (int w = from / 64; w < DIRSCAN_WORDS(per); w++) {
+            uint64_t bits = spare[w];
+            if (w == (int)(from / 64)) {
+                bits &= ~(uint64_t)0 << (from % 64);
+            }
+            if (bits != 0) {
+                unsigned int pos = c * per + w * 64 + __builtin_ctzll(bits);
+                if (pos < d->end_pos) {
+                    d->free_pos = pos;
+                    slot = pos_offset(d, pos);
+                }
+                done = 1;   // found, or reached the end marker
+                break;
+            }
+        }
+    }
+    free(buf);
+    return slot;
+}
+
+// image offset of the entry called name (raw 11-byte form) in the
+// directory starting at dir_cluster. builds the index on first use.
+// returns 0 if there is no such entry, -1 if the index could not be built
+off_t dirindex_lookup(blkdev *img, BPB *b, unsigned int dir_cluster, const unsigned char *name) {
+    dir_index *d = find_dir(dir_cluster);
+    if (d == NULL) {
+        d = build(img, b, dir_cluster);
+        if (d == NULL) {
+            return -1;
+        }
+    }
+    d->last_use = ++use_clock;
+
+    int i = find_slot(d, name);
+    return i >= 0 ? d->slots[i].offset : 0;
+}
+
+// an entry called name was written at offset
+void dirindex_add(unsigned int dir_cluster, const unsigned char *name, off_t offset) {
+    dir_index *d = find_dir(dir_cluster);
+    if (d == NULL) {
+        return;
+    }
+    int i = find_slot(d, name);
+    if (i >= 0) {
+        slot_freed(d, d->slots[i].offset);
+        slot_used(d, offset);
+        d->slots[i].offset = offset;
+        return;
+    }
+    if (make_room(d) != 0) {
+        forget(d);      // rebuilt from disk on the next lookup
+        return;
+    }
+    insert_slot(d, name, offset);
+    slot_used(d, offset);
+}
+
+// the entry called name was deleted or renamed
+void dirindex_remove(unsigned int dir_cluster, const unsigned char *name) {
+    dir_index *d = find_dir(dir_cluster);
+    if (d == NULL) {
+        return;
+    }
+    int i = find_slot(d, name);
+    if (i >= 0) {
+        slot_freed(d, d->slots[i].offset);
+        d->slots[i].offset = SLOT_DELETED;
+        d->count--;
+    }
+}
+
+// where a new entry can go in an indexed directory: the lowest free
+// slot, or 0 if the chain is full (*tail is set to its last cluster).
+// returns -1 if the directory is not indexed
+off_t dirindex_free_slot(blkdev *img, BPB *b, unsigned int dir_cluster, unsigned int *tail) {
+    dir_index *d = find_dir(dir_cluster);
+    if (d == NULL) {
+        return -1;
+    }
+    *tail = d->tail;
+
+    if (d->holes > 0) {
+        off_t slot = find_hole(img, b, d);
+        if (slot != 0) {
+            return slot;
+        }
+        d->holes = 0;   // the count was off: nothing free before the end
+    }
+    d->free_pos = d->end_pos;
+    if (d->end_pos >= d->chain_len * d->per_cluster) {
+        return 0;
+    }
+    return pos_offset(d, d->end_pos);
+}
+
+// cluster was linked after the tail of the directory
+void dirindex_grow(BPB *b, unsigned int dir_cluster, unsigned int cluster) {
+    dir_index *d = find_dir(dir_cluster);
+    if (d != NULL && append_cluster(d, b, cluster) != 0) {
+        forget(d);
+    }
+}
+
+void dirindex_drop(unsigned int dir_cluster) {
+    dir_index *d = find_dir(dir_cluster);
+    if (d != NULL) {
+        forget(d);
+    }
+}
+
+void dirindex_clear(void) {
+    for (int i = 0; i < DIRINDEX_DIRS; i++) {
+        forget(&dirs[i]);
+    }
+}
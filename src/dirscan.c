@@ -0,0 +1,315 @@
+#include "common.h"
+
+// the SSE2 code is compiled without a target attribute, so it is only
+// built where the compiler already targets SSE2 (always on x86-64; on
+// 32-bit x86 only with -msse2 or a later -march)
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#include <immintrin.h>
+#define DIRSCAN_X86 1
+#endif
+
+// classify up to 64 entries: returns the live bitmap, sets *spare and
+// *end (index of the end marker, or -1)
+typedef uint64_t (*block_fn)(const dir_entry *e, int n, uint64_t *spare, int *end);
+
+// first entry among the live bits whose name equals key, or -1
+typedef int (*match_fn)(const dir_entry *e, uint64_t live, const unsigned char *key);
+
+static uint64_t low_bits(int n) {
+    return n >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+}
+
+// ---- scalar ----
+
+static uint64_t block_scalar(const dir_entry *e, int n, uint64_t *spare, int *end) {
+    uint64_t live = 0;
+    uint64_t sp = 0;
+    *end = -1;
+
+    for (int i = 0; i < n; i++) {
+        unsigned char c = e[i].name[0];
+        if (c == 0x00) {
+            // the marker and everything after it is free
+            *end = i;
+            sp |= ~(uint64_t)0 << i;
+            break;
+        }
+        if (c == 0xE5) {
+            sp |= (uint64_t)1 << i;
+        } else if (!(e[i].attr & ATTR_VOLUME_ID)) {
+            // long-name parts carry the volume bit too
+            live |= (uint64_t)1 << i;
+        }
+    }
+
+    *spare = sp & low_bits(n);
+    return live;
+}
+
+static int match_scalar(const dir_entry *e, uint64_t live, const unsigned char *key) {
+    while (live) {
+        int i = __builtin_ctzll(live);
+        if (name_matches(&e[i], key)) {
+            return i;
+        }
+        live &= live - 1;
+    }
+    return -1;
+}
+
+#ifdef DIRSCAN_X86
+
+// ---- SSE2: 4 entries per step ----
+
+// fold 4- or 8-entry masks (bit k = entry k) into the block result.
+// returns 1 once the end marker has been seen
+static int fold_step(int i, int n, int endm, int delm, int volm, int width,
+                     uint64_t *live, uint64_t *sp, int *end) {
+    int valid = (1 << width) - 1;
+    if (endm) {
+        int k = __builtin_ctz(endm);
+        valid = (1 << k) - 1;
+        *end = i + k;
+    }
+    *live |= (uint64_t)(~(delm | volm) & valid) << i;
+    *sp |= (uint64_t)(delm & valid) << i;
+    if (*end >= 0) {
+        *sp |= (~(uint64_t)0 << *end) & low_bits(n);
+        return 1;
+    }
+    return 0;
+}
+
+// finish the last few entries of a block with the scalar code
+static uint64_t block_tail(const dir_entry *e, int i, int n, uint64_t live, uint64_t *sp, int *end) {
+    if (i < n) {
+        uint64_t tail_sp;
+        int tail_end;
+        live |= block_scalar(e + i, n - i, &tail_sp, &tail_end) << i;
+        *sp |= tail_sp << i;
+        if (tail_end >= 0) {
+            *end = i + tail_end;
+        }
+    }
+    return live;
+}
+
+static uint64_t block_sse2(const dir_entry *e, int n, uint64_t *spare, int *end) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i byte0 = _mm_set1_epi32(0xFF);
+    const __m128i deleted = _mm_set1_epi32(0xE5);
+    const __m128i volume = _mm_set1_epi32(ATTR_VOLUME_ID << 24);   // attr is byte 11
+
+    uint64_t live = 0;
+    uint64_t sp = 0;
+    *end = -1;
+
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        // transpose the first 16 bytes of 4 entries: dword 0 of each
+        // (name[0..3]) into head, dword 2 (name[8..10] + attr) into attr
+        __m128i v0 = _mm_loadu_si128((const __m128i *)&e[i]);
+        __m128i v1 = _mm_loadu_si128((const __m128i *)&e[i + 1]);
+        __m128i v2 = _mm_loadu_si128((const __m128i *)&e[i + 2]);
+        __m128i v3 = _mm_loadu_si128((const __m128i *)&e[i + 3]);
+        __m128i head = _mm_unpacklo_epi64(_mm_unpacklo_epi32(v0, v1), _mm_unpacklo_epi32(v2, v3));
+        __m128i attr = _mm_unpacklo_epi64(_mm_unpackhi_epi32(v0, v1), _mm_unpackhi_epi32(v2, v3));
+        __m128i first = _mm_and_si128(head, byte0);
+        int endm = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(first, zero)));
+        int delm = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(first, deleted)));
+        int volm = _mm_movemask_ps(_mm_castsi128_ps(
+                       _mm_cmpeq_epi32(_mm_and_si128(attr, volume), volume)));
+        if (fold_step(i, n, endm, delm, volm, 4, &live, &sp, end)) {
+            *spare = sp;
+            return live;
+        }
+    }
+
+    live = block_tail(e, i, n, live, &sp, end);
+    *spare = sp;
+    return live;
+}
+
+// the first 16 bytes of an entry against the key: name bytes 0..10 must match
+static int match_sse2(const dir_entry *e, uint64_t live, const unsigned char *key) {
+    unsigned char padded[16] = {0};
+    memcpy(padded, key, 11);
+    const __m128i k = _mm_loadu_si128((const __m128i *)padded);
+
+    while (live) {
+        int i = __builtin_ctzll(live);
+        __m128i v = _mm_loadu_si128((const __m128i *)&e[i]);
+        if ((_mm_movemask_epi8(_mm_cmpeq_epi8(v, k)) & 0x7FF) == 0x7FF) {
+            return i;
+        }
+        live &= live - 1;
+    }
+    return -1;
+}
+
+// ---- AVX2: 8 entries per step ----
+
+// the first 16 bytes of two entries, one per 128-bit lane
+__attribute__((target("avx2")))
+static __m256i pair_avx2(const dir_entry *lo, const dir_entry *hi) {
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)lo)),
+                                   _mm_loadu_si128((const __m128i *)hi), 1);
+}
+
+__attribute__((target("avx2")))
+static uint64_t block_avx2(const dir_entry *e, int n, uint64_t *spare, int *end) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i byte0 = _mm256_set1_epi32(0xFF);
+    const __m256i deleted = _mm256_set1_epi32(0xE5);
+    const __m256i volume = _mm256_set1_epi32(ATTR_VOLUME_ID << 24);
+
+    uint64_t live = 0;
+    uint64_t sp = 0;
+    *end = -1;
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        // same transpose as the SSE2 version, entries i..i+3 in the low
+        // lane and i+4..i+7 in the high lane
+        __m256i v0 = pair_avx2(&e[i], &e[i + 4]);
+        __m256i v1 = pair_avx2(&e[i + 1], &e[i + 5]);
+        __m256i v2 = pair_avx2(&e[i + 2], &e[i + 6]);
+        __m256i v3 = pair_avx2(&e[i + 3], &e[i + 7]);
+        __m256i head = _mm256_unpacklo_epi64(_mm256_unpacklo_epi32(v0, v1), _mm256_unpacklo_epi32(v2, v3));
+        __m256i attr = _mm256_unpacklo_epi64(_mm256_unpackhi_epi32(v0, v1), _mm256_unpackhi_epi32(v2, v3));
+        __m256i first = _mm256_and_si256(head, byte0);
+        int endm = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(first, zero)));
+        int delm = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(first, deleted)));
+        int volm = _mm256_movemask_ps(_mm256_castsi256_ps(
+                       _mm256_cmpeq_epi32(_mm256_and_si256(attr, volume), volume)));
+        if (fold_step(i, n, endm, delm, volm, 8, &live, &sp, end)) {
+            *spare = sp;
+            return live;
+        }
+    }
+
+    live = block_tail(e, i, n, live, &sp, end);
+    *spare = sp;
+    return live;
+}
+
+// two live entries per compare: one in each 128-bit lane
+__attribute__((target("avx2")))
+static int match_avx2(const dir_entry *e, uint64_t live, const unsigned char *key) {
+    unsigned char padded[16] = {0};
+    memcpy(padded, key, 11);
+    const __m256i k = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)padded));
+
+    while (live) {
+        int i = __builtin_ctzll(live);
+        live &= live - 1;
+        int j = live ? __builtin_ctzll(live) : i;
+        live &= live - 1;
+
+        __m256i v = pair_avx2(&e[i], &e[j]);
+        unsigned int m = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, k));
+        if ((m & 0x7FF) == 0x7FF) {
+            return i;
+        }
+        if (((m >> 16) & 0x7FF) == 0x7FF) {
+            return j;
+        }
+    }
+    return -1;
+}
+
+#endif
+
+static block_fn classify_block = block_scalar;
+static match_fn match_live = match_scalar;
+static const char *mode_name = NULL;
+
+// choose the scanner. returns -1 if the mode is unknown or the CPU
+// cannot run it
+int dirscan_init(const char *mode) {
+    if (strcmp(mode, "scalar") == 0) {
+        classify_block = block_scalar;
+        match_live = match_scalar;
+        mode_name = "scalar";
+        return 0;
+    }
+#ifdef DIRSCAN_X86
+    int avx2 = __builtin_cpu_supports("avx2");
+    if (strcmp(mode, "avx2") == 0 || (strcmp(mode, "auto") == 0 && avx2)) {
+        if (!avx2) {
+            return -1;
+        }
+        classify_block = block_avx2;
+        match_live = match_avx2;
+        mode_name = "avx2";
+        return 0;
+    }
+    if (strcmp(mode, "sse2") == 0 || strcmp(mode, "auto") == 0) {
+        classify_block = block_sse2;
+        match_live = match_sse2;
+        mode_name = "sse2";
+        return 0;
+    }
+#else
+    if (strcmp(mode, "auto") == 0) {
+        return dirscan_init("scalar");
+    }
+#endif
+    return -1;
+}
+
+const char *dirscan_mode(void) {
+    if (mode_name == NULL) {
+        dirscan_init("auto");
+    }
+    return mode_name;
+}
+
+// classify n entries into the live and spare bitmaps (DIRSCAN_WORDS(n)
+// words each). returns the index of the end marker, or n if there is none
+int dirscan_classify(const dir_entry *entries, int n, uint64_t *live, uint64_t *spare) {
+    if (mode_name == NULL) {
+        dirscan_init("auto");
+    }
+
+    int end = n;
+    for (int i = 0; i < n; i += 64) {
+        int w = i / 64;
+        if (end < n) {
+            // past the end marker every slot is free
+            live[w] = 0;
+            spare[w] = low_bits(n - i);
+            continue;
+        }
+        int block_end;
+        live[w] = classify_block(entries + i, n - i < 64 ? n - i : 64, &spare[w], &block_end);
+        if (block_end >= 0) {
+            end = i + block_end;
+        }
+    }
+    return end;
+}
+
+// index of the live entry called key (encoded), or -1. *end is set when
+// the end marker was reached, so the caller can stop following the chain
+int dirscan_find(const dir_entry *entries, int n, const unsigned char *key, int *end) {
+    if (mode_name == NULL) {
+        dirscan_init("auto");
+    }
+
+    *end = 0;
+    for (int i = 0; i < n; i += 64) {
+        uint64_t spare;
+        int block_end;
+        uint64_t live = classify_block(entries + i, n - i < 64 ? n - i : 64, &spare, &block_end);
+        int k = match_live(entries + i, live, key);
+        if (k >= 0) {
+            return i + k;
+        }
+        if (block_end >= 0) {
+            *end = 1;
+            return -1;
+        }
+    }
+    return -1;
+}
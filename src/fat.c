@@ -0,0 +1,326 @@
+#include "common.h"
+
+static uint32_t *fat_table = NULL;         // copy of FAT1
+static unsigned int fat_entries = 0;       // number of entries in fat_table
+static unsigned char *fat_dirty = NULL;    // one flag per FAT sector
+static unsigned int fat_sectors = 0;
+static unsigned int entry_shift = 0;        // log2(FAT entries per sector)
+static int fat_mapped = 0;                 // fat_table points into the mapping
+
+// free-cluster bitmap: bit set = cluster free. kept in sync by fat_set()
+static uint64_t *free_map = NULL;
+static unsigned int map_words = 0;
+static unsigned int max_cluster = 0;       // one past the last data cluster
+static unsigned int free_count = 0;
+static unsigned int next_free = 2;         // rotating search cursor
+
+static void map_mark_free(unsigned int cluster) {
+    uint64_t bit = (uint64_t)1 << (cluster & 63);
+    if (!(free_map[cluster >> 6] & bit)) {
+        free_map[cluster >> 6] |= bit;
+        free_count++;
+    }
+}
+
+static void map_mark_used(unsigned int cluster) {
+    uint64_t bit = (uint64_t)1 << (cluster & 63);
+    if (free_map[cluster >> 6] & bit) {
+        free_map[cluster >> 6] &= ~bit;
+        free_count--;
+    }
+}
+
+// build the bitmap from the cached FAT (done once at mount)
+static int build_free_map(BPB *b) {
+    max_cluster = b->cluster_count + 2;
+    if (max_cluster > fat_entries) {
+        max_cluster = fat_entries;
+    }
+
+    map_words = (max_cluster + 63) / 64;
+    free_map = (uint64_t *)calloc(map_words, sizeof(uint64_t));
+    if (free_map == NULL) {
+        return -1;
+    }
+
+    for (unsigned int c = 2; c < max_cluster; c++) {
+        if ((fat_table[c] & FAT_ENTRY_MASK) == FAT_FREE) {
+            free_map[c >> 6] |= (uint64_t)1 << (c & 63);
+        }
+    }
+
+    free_count = 0;
+    for (unsigned int w = 0; w < map_words; w++) {
+        free_count += __builtin_popcountll(free_map[w]);
+    }
+    next_free = 2;
+    return 0;
+}
+
+// first free cluster in [from, to), or 0 if none. scans a word at a time
+static unsigned int map_find(unsigned int from, unsigned int to) {
+    if (from >= to) {
+        return 0;
+    }
+
+    unsigned int w = from >> 6;
+    unsigned int last = (to - 1) >> 6;
+    uint64_t word = free_map[w] & (~(uint64_t)0 << (from & 63));
+
+    while (1) {
+        if (word != 0) {
+            unsigned int c = (w << 6) + __builtin_ctzll(word);
+            return c < to ? c : 0;
+        }
+        if (++w > last) {
+            return 0;
+        }
+        word = free_map[w];
+    }
+}
+
+static int map_is_free(unsigned int cluster) {
+    return cluster >= 2 && cluster < max_cluster &&
+           (free_map[cluster >> 6] >> (cluster & 63)) & 1;
+}
+
+// number of free clusters in a row starting at a free cluster, capped at max
+static unsigned int map_run_length(unsigned int start, unsigned int max) {
+    unsigned int c = start;
+    unsigned int len = 0;
+
+    while (len < max && c < max_cluster) {
+        // count the run of set bits from c within this word
+        uint64_t word = ~(free_map[c >> 6] >> (c & 63));
+        unsigned int avail = 64 - (c & 63);
+        unsigned int ones = (word == 0) ? avail : (unsigned int)__builtin_ctzll(word);
+        if (ones > avail) {
+            ones = avail;
+        }
+        if (c + ones > max_cluster) {
+            ones = max_cluster - c;
+        }
+
+        len += ones;
+        c += ones;
+        if (ones < avail) {
+            break;
+        }
+    }
+    return len < max ? len : max;
+}
+
+// first free run of at least want clusters starting in [from, to), or 0
+static unsigned int map_find_run(unsigned int from, unsigned int to, unsigned int want) {
+    unsigned int c = map_find(from, to);
+    while (c != 0) {
+        unsigned int len = map_run_length(c, want);
+        if (len >= want) {
+            return c;
+        }
+        c = map_find(c + len, to);
+    }
+    return 0;
+}
+
+// read the whole of FAT1 into memory (or use it in place when mapped)
+int fat_load(blkdev *img, BPB *b) {
+    size_t fat_bytes = b->fat_bytes;
+    off_t fat_start = b->fat_start;
+
+    fat_dirty = (unsigned char *)calloc(b->FATSz32, 1);
+    if (fat_dirty == NULL) {
+        printf("ERROR: Failed to allocate memory for the FAT.\n");
+        return -1;
+    }
+
+    if (blk_ptr(img, 0) != NULL) {
+        if (fat_start + (off_t)fat_bytes > blk_size(img)) {
+            printf("ERROR: Failed to read the FAT.\n");
+            fat_unload();
+            return -1;
+        }
+        fat_table = (uint32_t *)blk_ptr(img, fat_start);
+        fat_mapped = 1;
+    } else {
+        fat_table = (uint32_t *)malloc(fat_bytes);
+        if (fat_table == NULL) {
+            printf("ERROR: Failed to allocate memory for the FAT.\n");
+            fat_unload();
+            return -1;
+        }
+
+        // FAT1 starts right after the reserved sectors
+        if (blk_read_at(img, fat_start, fat_table, fat_bytes) != (long)fat_bytes) {
+            printf("ERROR: Failed to read the FAT.\n");
+            fat_unload();
+            return -1;
+        }
+    }
+
+    fat_entries = fat_bytes / sizeof(uint32_t);
+    fat_sectors = b->FATSz32;
+    entry_shift = b->sec_shift - 2;     // 4-byte entries
+
+    if (build_free_map(b) != 0) {
+        printf("ERROR: Failed to allocate memory for the free cluster map.\n");
+        fat_unload();
+        return -1;
+    }
+    return 0;
+}
+
+void fat_unload(void) {
+    if (!fat_mapped) {
+        free(fat_table);
+    }
+    fat_mapped = 0;
+    free(fat_dirty);
+    free(free_map);
+    fat_table = NULL;
+    fat_dirty = NULL;
+    free_map = NULL;
+    fat_entries = 0;
+    fat_sectors = 0;
+    map_words = 0;
+    max_cluster = 0;
+    free_count = 0;
+    next_free = 2;
+}
+
+// look up the FAT entry for a cluster (reserved high bits stripped)
+unsigned int fat_get(unsigned int cluster) {
+    if (cluster >= fat_entries) {
+        return FAT_FREE;
+    }
+    return fat_table[cluster] & FAT_ENTRY_MASK;
+}
+
+// change a FAT entry in memory, keeping the reserved high 4 bits
+void fat_set(unsigned int cluster, unsigned int value) {
+    if (cluster < 2 || cluster >= fat_entries) {
+        return;
+    }
+    fat_table[cluster] = (fat_table[cluster] & ~FAT_ENTRY_MASK) | (value & FAT_ENTRY_MASK);
+    fat_dirty[cluster >> entry_shift] = 1;
+
+    if (cluster < max_cluster) {
+        if ((value & FAT_ENTRY_MASK) == FAT_FREE) {
+            map_mark_free(cluster);
+        } else {
+            map_mark_used(cluster);
+        }
+    }
+}
+
+// allocate one free cluster and mark it as end of chain. returns 0 if
+// the volume is full
+unsigned int fat_alloc_cluster(void) {
+    return fat_extend_chain(0, 1);
+}
+
+// allocate count clusters and append them to the chain ending at tail
+// (tail 0 starts a new chain). returns the first new cluster, or 0 with
+// nothing allocated if there is not enough free space.
+//
+// placement: keep growing in place right after the tail while those
+// clusters are free; otherwise take the first run long enough for the
+// rest of the request, searching from the rotating cursor; only when no
+// such run exists is the request split over whatever runs come next.
+unsigned int fat_extend_chain(unsigned int tail, unsigned int count) {
+    if (count == 0 || free_count < count) {
+        return 0;
+    }
+
+    unsigned int first = 0;
+    unsigned int prev = tail;
+
+    while (count > 0) {
+        unsigned int start = 0;
+
+        if (prev >= 2 && map_is_free(prev + 1)) {
+            start = prev + 1;
+        } else {
+            start = map_find_run(next_free, max_cluster, count);
+            if (start == 0) {
+                start = map_find_run(2, next_free, count);
+            }
+            if (start == 0) {
+                // no single run is big enough, take the next free cluster
+                start = map_find(next_free, max_cluster);
+                if (start == 0) {
+                    start = map_find(2, next_free);
+                }
+            }
+        }
+        if (start == 0) {
+            return 0;   // unreachable while free_count is accurate
+        }
+
+        // link the run: prev -> start -> start + 1 -> ... -> EOC
+        unsigned int len = map_run_length(start, count);
+        if (prev >= 2) {
+            fat_set(prev, start);
+        }
+        for (unsigned int i = 0; i + 1 < len; i++) {
+            fat_set(start + i, start + i + 1);
+        }
+        fat_set(start + len - 1, FAT_EOC);
+
+        if (first == 0) {
+            first = start;
+        }
+        prev = start + len - 1;
+        count -= len;
+        next_free = prev + 1;
+    }
+
+    return first;
+}
+
+unsigned int fat_free_count(void) {
+    return free_count;
+}
+
+// mark every cluster in a chain as free
+void fat_free_chain(unsigned int cluster) {
+    while (cluster >= 2 && cluster < FAT_EOC) {
+        // get next cluster before freeing current one
+        unsigned int next = fat_get(cluster);
+        fat_set(cluster, FAT_FREE);
+        cluster = next;
+    }
+}
+
+// push dirty FAT sectors into the block cache for every FAT copy
+void fat_flush(blkdev *img, BPB *b) {
+    if (fat_table == NULL) {
+        return;
+    }
+
+    off_t fat_start = b->fat_start;
+    off_t fat_size = b->fat_bytes;
+
+    for (unsigned int s = 0; s < fat_sectors; s++) {
+        if (!fat_dirty[s]) {
+            continue;
+        }
+
+        // coalesce neighbouring dirty sectors into a single write
+        unsigned int end = s;
+        while (end + 1 < fat_sectors && fat_dirty[end + 1]) {
+            end++;
+        }
+
+        unsigned char *src = (unsigned char *)fat_table + ((size_t)s << b->sec_shift);
+        size_t len = (size_t)(end - s + 1) << b->sec_shift;
+        for (int i = 0; i < b->NumFATs; i++) {
+            // when the FAT is used in place, FAT1 is written onto itself,
+            // which only marks the pages dirty
+            cache_write(img, fat_start + i * fat_size + ((off_t)s << b->sec_shift), src, len);
+        }
+
+        memset(&fat_dirty[s], 0, end - s + 1);
+        s = end;
+    }
+}
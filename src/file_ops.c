@@ -1,12 +1,14 @@
 #include "common.h"
 
 
-void read_boot_sector(FILE* img, unsigned char* buf) {
+void read_boot_sector(blkdev* img, unsigned char* buf) {
 
     // buf will be 512 characters long (FAT32) and stores the boot sector
-    for(int i = 0; i < 512; i++) {
-        buf[i] = fgetc(img);
+    long got = blk_read_at(img, 0, buf, 512);
+    if (got < 0) {
+        got = 0;
     }
+    memset(buf + got, 0, 512 - got);
 }
 
 void parse_boot_sector(BPB *b, unsigned char* boot_sector) {
@@ -72,14 +74,51 @@ void parse_boot_sector(BPB *b, unsigned char* boot_sector) {
 
 }
 
+// power of two exponent of n, or -1 if n is not a power of two
+static int log2_exact(unsigned int n) {
+    if (n == 0 || (n & (n - 1)) != 0) {
+        return -1;
+    }
+    return __builtin_ctz(n);
+}
+
+// fill in the mount geometry of a parsed boot sector, so offsets are a
+// shift and an add from here on. returns -1 if the sector or cluster size
+// is not a power of two
+int mount_geometry(BPB *b) {
+    int sec_shift = log2_exact(b->BytesPerSec);
+    int spc_shift = log2_exact(b->SecPerClus);
+    if (sec_shift < 0 || spc_shift < 0) {
+        return -1;
+    }
+
+    b->sec_shift = sec_shift;
+    b->clus_shift = sec_shift + spc_shift;
+    b->cluster_size = 1u << b->clus_shift;
+    b->fat_start = (off_t)b->RsvdSecCnt << sec_shift;
+    b->fat_bytes = (off_t)b->FATSz32 << sec_shift;
+    b->data_start = b->fat_start + b->NumFATs * b->fat_bytes;
+
+    long data_sectors = (long)b->TotSec32 - ((long)b->RsvdSecCnt + (long)b->NumFATs * b->FATSz32);
+    b->cluster_count = data_sectors > 0 ? (unsigned int)(data_sectors >> spc_shift) : 0;
+    return 0;
+}
+
 // calculate the byte offset for a cluster
-unsigned int get_cluster_offset(BPB *b, unsigned int cluster) {
+off_t get_cluster_offset(BPB *b, unsigned int cluster) {
     // data region starts after reserved sectors and FATs
-    // byte offset = (RsvdSecCnt * BytesPerSec) + (NumFATs * FATSz32 * BytesPerSec)
-    //             + ((cluster - 2) * SecPerClus * BytesPerSec)
-    unsigned int data_region_start = (b->RsvdSecCnt * b->BytesPerSec) + (b->NumFATs * b->FATSz32 * b->BytesPerSec);
-    unsigned int cluster_offset = data_region_start + ((cluster - 2) * b->SecPerClus * b->BytesPerSec);
-    return cluster_offset;
+    return b->data_start + ((off_t)(cluster - 2) << b->clus_shift);
+}
+
+// the entries of the directory cluster at offset: used in place when the
+// image is mapped, else the whole cluster is read through the cache into
+// buf (cluster_size bytes)
+dir_entry* cluster_entries(blkdev* img, BPB *b, off_t offset, dir_entry *buf) {
+    if (blk_ptr(img, 0) != NULL) {
+        return (dir_entry *)blk_ptr(img, offset);
+    }
+    cache_read(img, offset, buf, b->cluster_size);
+    return buf;
 }
 
 // check if an entry is a dir
@@ -92,199 +131,447 @@ int is_longname(dir_entry *entry) {
     return (entry->attr & ATTR_LONG_NAME) == ATTR_LONG_NAME;
 }
 
-// trim trailing spaces from filename (FAT32 uses space padding)
-char* trim_filename(char *filename, int name_len) {
-    char *trimmed = (char *)malloc(name_len + 1);
-    int i = name_len - 1;
-    
-    // find last non-space character
-    while (i >= 0 && filename[i] == ' ') {
-        i--;
+// encode a name into the 11-byte form stored in a dir entry (space
+// padded, no dot handling), so entries can be matched with one fixed
+// size compare. returns 0 if the name is too long to match any entry
+int name_encode(const char *name, unsigned char *key) {
+    int i = 0;
+    while (name[i] && i < 11) {
+        key[i] = name[i];
+        i++;
     }
-    
-    // copy trimmed string
-    strncpy(trimmed, filename, i + 1);
-    trimmed[i + 1] = '\0';
-    
-    return trimmed;
+    if (name[i]) {
+        return 0;
+    }
+    memset(key + i, ' ', 11 - i);
+    return 1;
+}
+
+// does an entry carry the encoded name key
+int name_matches(const dir_entry *entry, const unsigned char *key) {
+    return memcmp(entry->name, key, 11) == 0;
 }
 
-// read all dir entries from a cluster
-dir_entry* read_dir(FILE* img, BPB *b, unsigned int cluster, int *entry_count) {
-    unsigned int offset = get_cluster_offset(b, cluster);
-    unsigned int cluster_size = b->SecPerClus * b->BytesPerSec;
+// copy an entry's name without the padding into out (12 bytes)
+void name_decode(const unsigned char *raw, char *out) {
+    int len = 11;
+    while (len > 0 && raw[len - 1] == ' ') {
+        len--;
+    }
+    memcpy(out, raw, len);
+    out[len] = '\0';
+}
+
+// get the next cluster in the chain from the FAT
+unsigned int get_next_cluster(blkdev* img, BPB *b, unsigned int cluster) {
+    if (cluster >= 0x0FFFFFF8) {
+        // end of cluster chain
+        return 0;
+    }
     
-    // calculate max entries in cluster (each entry is 32 bytes)
+    // FAT is cached in memory at mount, so no disk access is needed
+    return fat_get(cluster);
+}
+
+// get root cluster from BPB
+unsigned int get_root_cluster(BPB *b) { return b->RootClus; }
+
+// linear search of a directory chain, used when the directory could
+// not be indexed
+static int scan_chain(blkdev* img, BPB *b, unsigned int cluster, const unsigned char* key,
+                      dir_entry* out, off_t* offset) {
+    unsigned int cluster_size = b->cluster_size;
     int max_entries = cluster_size / sizeof(dir_entry);
-    
-    // allocate space for entries
-    dir_entry *temp_entries = (dir_entry *)malloc(max_entries * sizeof(dir_entry));
-    dir_entry *entries = (dir_entry *)malloc(max_entries * sizeof(dir_entry));
-    
-    if (temp_entries == NULL || entries == NULL) {
+
+    dir_entry* buf = (dir_entry*)malloc(cluster_size);
+    if (buf == NULL) {
         printf("ERROR: Failed to allocate memory for directory entries.\n");
-        if (temp_entries) free(temp_entries);
-        if (entries) free(entries);
-        *entry_count = 0;
-        return NULL;
+        return 0;
     }
-    
-    // seek to cluster position and read entries
-    fseek(img, offset, SEEK_SET);
-    int count = 0;
-    
-    for (int i = 0; i < max_entries; i++) {
-        size_t bytes_read = fread(&temp_entries[i], sizeof(dir_entry), 1, img);
-        if (bytes_read != 1) {
-            break;
+
+    while (cluster != 0 && cluster < 0x0FFFFFF8) {
+        off_t cluster_start = get_cluster_offset(b, cluster);
+        dir_entry* entries = cluster_entries(img, b, cluster_start, buf);
+
+        int end;
+        int i = dirscan_find(entries, max_entries, key, &end);
+        if (i >= 0) {
+            memcpy(out, &entries[i], sizeof(dir_entry));
+            *offset = cluster_start + i * sizeof(dir_entry);
+            free(buf);
+            return 1;
         }
-        
-        // stop at first free entry (name[0] == 0x00)
-        if (temp_entries[i].name[0] == 0x00) {
+        if (end) {
             break;
         }
-        
-        // skip deleted entries (name[0] == 0xE5)
-        if (temp_entries[i].name[0] == 0xE5) {
-            continue;
-        }
-        
-        // skip long filename entries
-        if (is_longname(&temp_entries[i])) {
-            continue;
-        }
-        
-        // copy valid entry to result array
-        memcpy(&entries[count], &temp_entries[i], sizeof(dir_entry));
-        count++;
+
+        cluster = get_next_cluster(img, b, cluster);
     }
-    
-    free(temp_entries);
-    *entry_count = count;
-    return entries;
+
+    free(buf);
+    return 0;
 }
 
-// get the next cluster in the chain from the FAT
-unsigned int get_next_cluster(FILE* img, BPB *b, unsigned int cluster) {
-    if (cluster >= 0x0FFFFFF8) {
-        // end of cluster chain
+// find a dir entry by name anywhere in a directory's cluster chain.
+// copies the entry to *out and its byte offset in the image to *offset.
+// returns 1 if found, 0 if not. goes through the directory's name index
+int find_entry_in_chain(blkdev* img, BPB *b, unsigned int cluster, const char* name,
+                        dir_entry* out, off_t* offset) {
+    // the index is keyed by the raw space padded name
+    unsigned char key[11];
+    if (!name_encode(name, key)) {
         return 0;
     }
-    
-    // FAT starts at RsvdSecCnt * BytesPerSec
-    unsigned int fat_offset = b->RsvdSecCnt * b->BytesPerSec;
-    
-    // each FAT entry is 4 bytes (32-bit for FAT32)
-    // position in FAT for our cluster: fat_offset + (cluster * 4)
-    unsigned int entry_offset = fat_offset + (cluster * 4);
-    
-    // save current position
-    long original_pos = ftell(img);
-    
-    // seek to FAT entry and read it
-    fseek(img, entry_offset, SEEK_SET);
-    unsigned char fat_entry[4];
-    if (fread(fat_entry, 4, 1, img) != 1) {
-        fseek(img, original_pos, SEEK_SET);
+
+    off_t at = dirindex_lookup(img, b, cluster, key);
+    if (at < 0) {
+        return scan_chain(img, b, cluster, key, out, offset);
+    }
+    if (at == 0) {
         return 0;
     }
-    
-    // convert little-endian FAT entry to cluster number
-    unsigned int next_cluster = fat_entry[0] | (fat_entry[1] << 8) | 
-                                 (fat_entry[2] << 16) | (fat_entry[3] << 24);
-    
-    // only keep lower 28 bits (FAT32 uses bits 0-27, bits 28-31 are reserved)
-    next_cluster &= 0x0FFFFFFF;
-    
-    // restore original position
-    fseek(img, original_pos, SEEK_SET);
-    
-    return next_cluster;
+
+    cache_read(img, at, out, sizeof(dir_entry));
+    *offset = at;
+    return 1;
 }
 
-// get root cluster from BPB
-unsigned int get_root_cluster(BPB *b) { return b->RootClus; }
+// load and classify the iterator's current cluster
+static void dir_iter_load(dir_iter *it) {
+    it->cluster_start = get_cluster_offset(it->b, it->cluster);
+    it->entries = cluster_entries(it->img, it->b, it->cluster_start, it->buf);
 
-// find a specific dir entry by name in a single cluster
-dir_entry* find_entry_in_cluster(FILE* img, BPB *b, unsigned int cluster, char* name) {
-    int entry_count = 0;
-    dir_entry* entries = read_dir(img, b, cluster, &entry_count);
-    
-    if (entries == NULL || entry_count == 0) {
-        if (entries) free(entries);
-        return NULL;
+    it->at_end = dirscan_classify(it->entries, it->max_entries, it->live, it->spare) < it->max_entries;
+    it->word = 0;
+    it->bits = it->live[0];
+}
+
+// start walking the directory whose first cluster is cluster.
+// returns -1 if the buffers could not be allocated
+int dir_iter_open(dir_iter *it, blkdev* img, BPB *b, unsigned int cluster) {
+    unsigned int cluster_size = b->cluster_size;
+    it->img = img;
+    it->b = b;
+    it->max_entries = cluster_size / sizeof(dir_entry);
+    it->buf = (dir_entry *)malloc(cluster_size);
+    it->live = (uint64_t *)malloc(2 * DIRSCAN_WORDS(it->max_entries) * sizeof(uint64_t));
+    if (it->buf == NULL || it->live == NULL) {
+        printf("ERROR: Failed to allocate memory for directory entries.\n");
+        free(it->buf);
+        free(it->live);
+        it->buf = NULL;
+        it->live = NULL;
+        it->cluster = 0;
+        return -1;
     }
-    
-    // search for matching entry
-    for (int i = 0; i < entry_count; i++) {
-        // skip volume labels
-        if ((entries[i].attr & ATTR_VOLUME_ID) != 0) {
-            continue;
+    it->spare = it->live + DIRSCAN_WORDS(it->max_entries);
+
+    it->cluster = (cluster != 0 && cluster < FAT_EOC) ? cluster : 0;
+    if (it->cluster != 0) {
+        dir_iter_load(it);
+    }
+    return 0;
+}
+
+// next live entry (not deleted, not a long-name part, not the volume
+// label) and its byte offset in the image, or NULL at the end of the
+// directory. the pointer is valid until the next call
+dir_entry* dir_iter_next(dir_iter *it, off_t *offset) {
+    while (it->cluster != 0) {
+        while (it->bits == 0 && it->word + 1 < DIRSCAN_WORDS(it->max_entries)) {
+            it->bits = it->live[++it->word];
         }
-        
-        char* trimmed = trim_filename((char*)entries[i].name, 11);
-        if (strcmp(trimmed, name) == 0) {
-            // found it - allocate new entry and return
-            dir_entry* result = (dir_entry*)malloc(sizeof(dir_entry));
-            memcpy(result, &entries[i], sizeof(dir_entry));
-            free(trimmed);
-            free(entries);
-            return result;
+        if (it->bits != 0) {
+            int i = it->word * 64 + __builtin_ctzll(it->bits);
+            it->bits &= it->bits - 1;
+            if (offset != NULL) {
+                *offset = it->cluster_start + i * sizeof(dir_entry);
+            }
+            return &it->entries[i];
+        }
+
+        // cluster done: stop at the end marker, else follow the chain
+        unsigned int next = it->at_end ? 0 : get_next_cluster(it->img, it->b, it->cluster);
+        it->cluster = (next != 0 && next < FAT_EOC) ? next : 0;
+        if (it->cluster != 0) {
+            dir_iter_load(it);
         }
-        free(trimmed);
     }
-    
-    free(entries);
     return NULL;
 }
 
-// read all dir entries following the cluster chain
-dir_entry* read_dir_chain(FILE* img, BPB *b, unsigned int cluster, int *entry_count) {
-    // allocate initial space for entries (start with reasonable size)
-    int max_entries = 256;  // should be enough for most directories
-    dir_entry* all_entries = (dir_entry*)malloc(max_entries * sizeof(dir_entry));
-    
-    if (all_entries == NULL) {
-        printf("ERROR: Failed to allocate memory for directory chain.\n");
-        *entry_count = 0;
-        return NULL;
+void dir_iter_close(dir_iter *it) {
+    free(it->buf);
+    free(it->live);
+    it->buf = NULL;
+    it->live = NULL;
+    it->cluster = 0;
+}
+
+// add one cluster to the end of a file's extent list
+static int extent_push(file_table *f, unsigned int cluster) {
+    if (f->extent_count > 0) {
+        extent *last = &f->extents[f->extent_count - 1];
+        if (last->physical + last->count == cluster) {
+            // physically follows the last run, just grow it
+            last->count++;
+            f->nclusters++;
+            return 0;
+        }
     }
-    
-    int total_count = 0;
-    unsigned int current_cluster = cluster;
-    
-    // follow cluster chain
-    while (current_cluster != 0 && current_cluster < 0x0FFFFFF8) {
-        int cluster_entry_count = 0;
-        dir_entry* cluster_entries = read_dir(img, b, current_cluster, &cluster_entry_count);
-        
-        if (cluster_entries == NULL) {
+
+    if (f->extent_count >= f->extent_cap) {
+        int new_cap = f->extent_cap ? f->extent_cap * 2 : 8;
+        extent *temp = (extent *)realloc(f->extents, new_cap * sizeof(extent));
+        if (temp == NULL) {
+            printf("ERROR: Failed to allocate memory for extent list.\n");
+            return -1;
+        }
+        f->extents = temp;
+        f->extent_cap = new_cap;
+    }
+
+    f->extents[f->extent_count].logical = f->nclusters;
+    f->extents[f->extent_count].physical = cluster;
+    f->extents[f->extent_count].count = 1;
+    f->extent_count++;
+    f->nclusters++;
+    return 0;
+}
+
+// build the extent list of an open file by walking its chain once
+void extent_build(blkdev* img, BPB *b, file_table *f, unsigned int first_cluster) {
+    extent_clear(f);
+    if (extent_append(img, b, f, first_cluster) == 0) {
+        f->extents_loaded = 1;
+    }
+}
+
+// append the chain starting at cluster to the end of the extent list
+// (used after new clusters are linked behind the file's tail)
+int extent_append(blkdev* img, BPB *b, file_table *f, unsigned int cluster) {
+    while (cluster != 0 && cluster < 0x0FFFFFF8) {
+        if (extent_push(f, cluster) != 0) {
+            // out of memory: drop the list, it gets rebuilt on next access
+            extent_clear(f);
+            return -1;
+        }
+        cluster = get_next_cluster(img, b, cluster);
+    }
+    return 0;
+}
+
+static int extent_contains(extent *e, unsigned int logical) {
+    return logical >= e->logical && logical < e->logical + e->count;
+}
+
+// physical cluster holding the logical'th cluster of the file, or 0 if
+// the file is shorter than that. the handle's cursor is tried first (same
+// or next run), so sequential access is O(1); anything else is a binary
+// search over the runs
+unsigned int extent_lookup(file_table *f, unsigned int logical) {
+    int found = -1;
+
+    if (f->cur_extent < f->extent_count) {
+        if (extent_contains(&f->extents[f->cur_extent], logical)) {
+            found = f->cur_extent;
+        } else if (f->cur_extent + 1 < f->extent_count &&
+                   extent_contains(&f->extents[f->cur_extent + 1], logical)) {
+            found = f->cur_extent + 1;
+        }
+    }
+
+    if (found < 0) {
+        int lo = 0;
+        int hi = f->extent_count - 1;
+        while (lo <= hi) {
+            int mid = lo + (hi - lo) / 2;
+            extent *e = &f->extents[mid];
+            if (logical < e->logical) {
+                hi = mid - 1;
+            } else if (logical >= e->logical + e->count) {
+                lo = mid + 1;
+            } else {
+                found = mid;
+                break;
+            }
+        }
+    }
+
+    if (found < 0) {
+        return 0;
+    }
+
+    // move the cursor to where we are now
+    extent *e = &f->extents[found];
+    f->cur_extent = found;
+    f->cur_logical = logical;
+    f->cur_physical = e->physical + (logical - e->logical);
+    return f->cur_physical;
+}
+
+// last cluster of the file, or 0 if it has none
+unsigned int extent_tail(file_table *f) {
+    if (f->extent_count == 0) {
+        return 0;
+    }
+    extent *last = &f->extents[f->extent_count - 1];
+    return last->physical + last->count - 1;
+}
+
+void extent_clear(file_table *f) {
+    free(f->extents);
+    f->extents = NULL;
+    f->extent_count = 0;
+    f->extent_cap = 0;
+    f->nclusters = 0;
+    f->extents_loaded = 0;
+    f->cur_extent = 0;
+    f->cur_logical = 0;
+    f->cur_physical = 0;
+    f->ra_count = 0;            // read-ahead data was found through the old list
+}
+
+// segment list reused by file_segments()
+static blk_seg *seg_list = NULL;
+static int seg_cap = 0;
+
+// split [offset, offset + len) of an open file into image segments that
+// point into buf, one per physically contiguous run of clusters. the
+// extent list must be loaded. stops early at the end of the chain.
+// returns the number of segments (the list is reused by the next call)
+int file_segments(BPB *b, file_table *f, off_t offset, void *buf, int len, blk_seg **out) {
+    unsigned int cluster_size = b->cluster_size;
+    unsigned char *dst = (unsigned char *)buf;
+    int n = 0;
+    int done = 0;
+
+    while (done < len) {
+        off_t pos = offset + done;
+        unsigned int logical = pos >> b->clus_shift;
+        unsigned int in_cluster = pos & (cluster_size - 1);
+        unsigned int cluster = extent_lookup(f, logical);
+        if (cluster == 0) {
             break;
         }
-        
-        // copy entries from this cluster
-        for (int i = 0; i < cluster_entry_count; i++) {
-            if (total_count >= max_entries) {
-                // need to expand
-                max_entries *= 2;
-                dir_entry* temp = (dir_entry*)realloc(all_entries, max_entries * sizeof(dir_entry));
-                if (temp == NULL) {
-                    free(cluster_entries);
-                    *entry_count = total_count;
-                    return all_entries;  // return what we have
-                }
-                all_entries = temp;
+
+        // extend the segment while the next cluster is physically adjacent
+        int chunk = cluster_size - in_cluster;
+        unsigned int run = 1;
+        while (chunk < len - done && extent_lookup(f, logical + run) == cluster + run) {
+            chunk += cluster_size;
+            run++;
+        }
+        if (chunk > len - done) {
+            chunk = len - done;
+        }
+
+        if (n == seg_cap) {
+            int cap = seg_cap > 0 ? seg_cap * 2 : 16;
+            blk_seg *grown = (blk_seg *)realloc(seg_list, cap * sizeof(blk_seg));
+            if (grown == NULL) {
+                break;
             }
-            memcpy(&all_entries[total_count], &cluster_entries[i], sizeof(dir_entry));
-            total_count++;
+            seg_list = grown;
+            seg_cap = cap;
         }
-        
-        free(cluster_entries);
-        
-        // get next cluster in chain
-        current_cluster = get_next_cluster(img, b, current_cluster);
+        seg_list[n].offset = get_cluster_offset(b, cluster) + in_cluster;
+        seg_list[n].buf = dst + done;
+        seg_list[n].len = chunk;
+        seg_list[n].done = 0;
+        n++;
+        done += chunk;
     }
-    
-    *entry_count = total_count;
-    return all_entries;
+
+    *out = seg_list;
+    return n;
+}
+
+// total bytes covered by a segment list
+static int segments_len(blk_seg *segs, int n) {
+    int total = 0;
+    for (int i = 0; i < n; i++) {
+        total += segs[i].len;
+    }
+    return total;
+}
+
+// fill the handle's read-ahead buffer with the clusters starting at
+// logical. the window goes out as one batch of segments, one segment per
+// physically contiguous run of clusters.
+// returns the number of clusters buffered (0 if none could be)
+static unsigned int readahead_fill(blkdev* img, BPB *b, file_table *f, unsigned int logical) {
+    unsigned int cluster_size = b->cluster_size;
+    unsigned int window = READAHEAD_BYTES / cluster_size;
+    if (window == 0) {
+        window = 1;
+    }
+
+    if (f->ra_buf == NULL) {
+        f->ra_buf = (unsigned char *)malloc((size_t)window * cluster_size);
+        if (f->ra_buf == NULL) {
+            return 0;
+        }
+    }
+
+    if (logical >= f->nclusters) {
+        return 0;
+    }
+    unsigned int count = f->nclusters - logical;
+    if (count > window) {
+        count = window;
+    }
+
+    // the whole window is read as one batch of segments
+    blk_seg *segs;
+    int n = file_segments(b, f, (off_t)logical << b->clus_shift, f->ra_buf, count * cluster_size, &segs);
+    cache_read_segs(img, segs, n);
+
+    f->ra_logical = logical;
+    f->ra_count = segments_len(segs, n) / cluster_size;
+    return f->ra_count;
+}
+
+// read len bytes at offset from an open file into buf. the extent list
+// must already be loaded. reads that continue where the previous one
+// stopped are served from a read-ahead buffer that is refilled
+// READAHEAD_BYTES at a time; other reads are split into one segment per
+// contiguous run and read as a single batch.
+// returns the number of bytes read
+int file_read_at(blkdev* img, BPB *b, file_table *f, off_t offset, unsigned char *buf, int len) {
+    unsigned int cluster_size = b->cluster_size;
+    // a mapped image is already read ahead by the kernel
+    int sequential = (offset == f->seq_offset) && blk_ptr(img, 0) == NULL;
+    int done = 0;
+
+    while (done < len) {
+        off_t pos = offset + done;
+        unsigned int logical = pos >> b->clus_shift;
+        unsigned int in_cluster = pos & (cluster_size - 1);
+
+        int chunk = cluster_size - in_cluster;
+        if (chunk > len - done) {
+            chunk = len - done;
+        }
+
+        if (f->ra_count > 0 && logical >= f->ra_logical && logical < f->ra_logical + f->ra_count) {
+            // already buffered
+            size_t at = (size_t)(logical - f->ra_logical) * cluster_size + in_cluster;
+            memcpy(buf + done, f->ra_buf + at, chunk);
+        } else if (sequential && readahead_fill(img, b, f, logical) > 0) {
+            continue;   // served from the buffer on the next pass
+        } else {
+            // not buffered: the rest of the request goes out as one batch
+            blk_seg *segs;
+            int n = file_segments(b, f, pos, buf + done, len - done, &segs);
+            cache_read_segs(img, segs, n);
+            done += segments_len(segs, n);
+            break;
+        }
+
+        done += chunk;
+    }
+
+    f->seq_offset = offset + done;
+    return done;
 }
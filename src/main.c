@@ -3,7 +3,7 @@ file_table table[10];
 
 int main(int argc, char* argv[]) {
 
-    FILE *img;      // file ptr to img file
+    blkdev *img;    // the img file
     bool exit = 0;
     unsigned int current_cluster;  // track current working dir cluster
 
@@ -15,6 +15,7 @@ int main(int argc, char* argv[]) {
         table[i].index = i;
         memset(table[i].filename, 0, 256);
         memset(table[i].path, 0, 512);
+        extent_clear(&table[i]);
     }
 
     if(bpb == NULL) {
@@ -22,13 +23,42 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
-    if(argc == 2) {
+    // optional flags after the image name
+    //  --dirty-max=N   dirty cache blocks allowed before a write-back
+    //  --io=BACKEND    how the image is accessed: pread (default), stdio,
+    //                  mmap or uring
+    //  --mmap          same as --io=mmap
+    //  --qd=N          requests kept in flight by the uring backend
+    //  --scan=MODE     directory scanner: auto (default), avx2, sse2, scalar
+    unsigned int dirty_max = CACHE_DIRTY_MAX;
+    unsigned int queue_depth = BLK_QUEUE_DEPTH;
+    const char *io = "pread";
+
+    if(argc >= 2) {
         printf("%s\n", argv[0]);  // executable name  (./filesys)
         printf("%s\n", argv[1]);  // "first" argument (the file we want to mount)
     } else {
         printf("Incorrect Arguments\n");
     }
 
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--dirty-max=", 12) == 0) {
+            dirty_max = atoi(argv[i] + 12);
+        } else if (strncmp(argv[i], "--io=", 5) == 0) {
+            io = argv[i] + 5;
+        } else if (strncmp(argv[i], "--qd=", 5) == 0) {
+            queue_depth = atoi(argv[i] + 5);
+        } else if (strncmp(argv[i], "--scan=", 7) == 0) {
+            if (dirscan_init(argv[i] + 7) != 0) {
+                printf("Scanner %s is not available\n", argv[i] + 7);
+            }
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            io = "mmap";
+        } else {
+            printf("Unknown option %s\n", argv[i]);
+        }
+    }
+
     /* to "MOUNT" the file
             1. Open the file (big array of bytes)
             2. Read the boot sector
@@ -66,8 +96,7 @@ int main(int argc, char* argv[]) {
 
     // attempt to open the .img file
     // if cant open, return error
-    // r+ = do reads and writes on the file
-    img = fopen(argv[1], "r+");
+    img = blk_open(argv[1], io, queue_depth);
 
     if (img == NULL) {
         // error, exit the program
@@ -83,6 +112,27 @@ int main(int argc, char* argv[]) {
 
     // get information from the boot_sector
     parse_boot_sector(bpb, boot_sector);
+    if (mount_geometry(bpb) != 0) {
+        printf("Error: %s has an unsupported sector or cluster size\n", argv[1]);
+        blk_close(img);
+        free(bpb);
+        return 1;
+    }
+
+    // cache the FAT in memory
+    if (fat_load(img, bpb) != 0) {
+        blk_close(img);
+        free(bpb);
+        return 1;
+    }
+
+    // block cache for everything else
+    if (cache_init(img, bpb, dirty_max) != 0) {
+        fat_unload();
+        blk_close(img);
+        free(bpb);
+        return 1;
+    }
 
     // initialize current dir to root cluster
     current_cluster = bpb->RootClus;
@@ -151,7 +201,12 @@ int main(int argc, char* argv[]) {
             open(tokens->items[1], tokens->items[2], img, bpb, current_cluster, table, argv[1]);
         }
         if ((strcmp(tokens->items[0], "close") == 0) && tokens->size == 2) {
-            close(tokens->items[1], table);
+            close(tokens->items[1], img, bpb, table);
+        }
+        
+        // sync command
+        if ((strcmp(tokens->items[0], "sync") == 0) && tokens->size == 1) {
+            sync_image(img, bpb, table);
         }
         
         if ((strcmp(tokens->items[0], "lsof") == 0) && tokens->size == 1) {
@@ -159,13 +214,27 @@ int main(int argc, char* argv[]) {
         }
         
         if ((strcmp(tokens->items[0], "lseek") == 0) && tokens->size == 3) {
-            int offset = atoi(tokens->items[2]);
-            lseek(tokens->items[1], offset, table);
+            off_t offset = strtoll(tokens->items[2], NULL, 10);
+            lseek(tokens->items[1], offset, img, bpb, table);
         }
         
-        if ((strcmp(tokens->items[0], "read") == 0) && tokens->size == 3) {
-            int size = atoi(tokens->items[2]);
-            read(tokens->items[1], size, img, bpb, table, current_cluster);
+        // read FILE SIZE [-x | -raw]
+        if ((strcmp(tokens->items[0], "read") == 0) && (tokens->size == 3 || tokens->size == 4)) {
+            off_t size = strtoll(tokens->items[2], NULL, 10);
+            int mode = READ_TEXT;
+            if (tokens->size == 4) {
+                if (strcmp(tokens->items[3], "-x") == 0) {
+                    mode = READ_HEX;
+                } else if (strcmp(tokens->items[3], "-raw") == 0) {
+                    mode = READ_RAW;
+                } else {
+                    mode = -1;
+                    printf("Error: Usage: read [FILENAME] [SIZE] [-x | -raw]\n");
+                }
+            }
+            if (mode >= 0) {
+                read(tokens->items[1], size, mode, img, bpb, table);
+            }
         }
 
         if (strcmp(tokens->items[0], "write") == 0) {
@@ -199,7 +268,7 @@ int main(int argc, char* argv[]) {
                 if (ends_with_quote) break;
             }
         
-                write_file(tokens->items[1], string_buf, img, bpb, table, current_cluster);
+                write_file(tokens->items[1], string_buf, img, bpb, table);
             } else {
                 printf("Error: Usage: write [FILENAME] [STRING]\n");
             }
@@ -218,6 +287,16 @@ int main(int argc, char* argv[]) {
             rm(tokens->items[1], img, bpb, current_cluster, table);
         }
 
+        // import command
+        if ((strcmp(tokens->items[0], "import") == 0) && tokens->size == 3) {
+            import_file(tokens->items[1], tokens->items[2], img, bpb, current_cluster);
+        }
+
+        // export command
+        if ((strcmp(tokens->items[0], "export") == 0) && tokens->size == 3) {
+            export_file(tokens->items[1], tokens->items[2], img, bpb, current_cluster, table);
+        }
+
         // rmdir command
         if ((strcmp(tokens->items[0], "rmdir") == 0) && tokens->size == 2) {
             rmdir_cmd(tokens->items[1], img, bpb, current_cluster, table);
@@ -228,8 +307,12 @@ int main(int argc, char* argv[]) {
 		free_tokens(tokens);
 	}
 
-    // close img file
-    fclose(img);
+    // write back any cached changes and close img file
+    sync_image(img, bpb, table);
+    dirindex_clear();
+    cache_free();
+    fat_unload();
+    blk_close(img);
 
     // free remaining memory
     free(bpb);
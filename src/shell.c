@@ -15,35 +15,54 @@ void init_path(void) {
     strcpy(current_path, "/");
 }
 
-void update_path(char* dirname, int is_entering) {
-    if (is_entering) {
-        // entering a dir - append to path
-        if (strcmp(dirname, "..") == 0) {
-            // go back to parent dir
-            int len = strlen(current_path);
-            if (len > 1) {
-                // remove trailing slash if exists
-                if (current_path[len - 1] == '/') {
-                    current_path[len - 1] = '\0';
-                    len--;
-                }
-                // find last slash
-                int last_slash = len - 1;
-                while (last_slash > 0 && current_path[last_slash] != '/') {
-                    last_slash--;
-                }
-                // truncate at last slash
-                current_path[last_slash + 1] = '\0';
+// apply one path component to path (a directory path ending in '/')
+static void apply_component(char *path, const char *dirname) {
+    if (strcmp(dirname, "..") == 0) {
+        // go back to parent dir
+        int len = strlen(path);
+        if (len > 1) {
+            // remove trailing slash if exists
+            if (path[len - 1] == '/') {
+                path[len - 1] = '\0';
+                len--;
             }
-        } else if (strcmp(dirname, ".") != 0) {
-            // enter a subdirectory (skip ".")
-            if (strlen(current_path) + strlen(dirname) + 2 < MAX_PATH_LEN) {
-                if (current_path[strlen(current_path) - 1] != '/') {
-                    strcat(current_path, "/");
-                }
-                strcat(current_path, dirname);
-                strcat(current_path, "/");
+            // find last slash
+            int last_slash = len - 1;
+            while (last_slash > 0 && path[last_slash] != '/') {
+                last_slash--;
+            }
+            // truncate at last slash
+            path[last_slash + 1] = '\0';
+        }
+    } else if (dirname[0] != '\0' && strcmp(dirname, ".") != 0) {
+        // enter a subdirectory (skip ".")
+        if (strlen(path) + strlen(dirname) + 2 < MAX_PATH_LEN) {
+            if (path[strlen(path) - 1] != '/') {
+                strcat(path, "/");
             }
+            strcat(path, dirname);
+            strcat(path, "/");
         }
     }
 }
+
+// follow rel (absolute, or relative to path) one component at a time
+void path_apply(char *path, const char *rel) {
+    if (rel[0] == '/') {
+        strcpy(path, "/");
+    }
+
+    char buf[MAX_PATH_LEN];
+    strncpy(buf, rel, MAX_PATH_LEN - 1);
+    buf[MAX_PATH_LEN - 1] = '\0';
+    for (char *name = strtok(buf, "/"); name != NULL; name = strtok(NULL, "/")) {
+        apply_component(path, name);
+    }
+}
+
+void update_path(char* dirname, int is_entering) {
+    if (is_entering) {
+        // entering a dir (or a path of them) - apply it to the path
+        path_apply(current_path, dirname);
+    }
+}